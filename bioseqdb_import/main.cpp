@@ -1,13 +1,58 @@
+#include <algorithm>
+#include <cctype>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include <libpq-fe.h>
 
-void check_pg(PGconn* connection, PGresult* result) {
-    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+// Rows are sent with one COPY per batch, which is flushed after this many rows or bytes.
+constexpr size_t batch_rows = 1000;
+constexpr size_t batch_bytes = 64 << 20;
+
+struct Replacement {
+    // Applied only to rows where condition_column equals condition_value, unless condition_column is empty.
+    std::string condition_column;
+    std::string condition_value;
+    std::string from;
+    std::string to;
+};
+
+struct ColumnMapping {
+    std::string target;
+    std::string source;
+    // One of "text", "date", "age" or "country_code".
+    std::string transform;
+};
+
+// Describes how a metadata CSV is joined with the FASTA headers and mapped onto table columns. See
+// use_case/import.conf for the format.
+struct ImportConfig {
+    char header_cut = '\0';
+    char delimiter = ',';
+    std::string key_column = "strain";
+    std::vector<std::string> null_values = {"unknown", "?"};
+    // Whether every metadata row must match exactly one sequence. Otherwise the rows that do not are only reported.
+    bool strict = true;
+    std::vector<Replacement> replacements;
+    std::vector<ColumnMapping> columns;
+    std::unordered_map<std::string, std::string> country_codes;
+};
+
+using MetadataRow = std::vector<std::optional<std::string>>;
+
+[[noreturn]] void fail(const std::string& message) {
+    std::cerr << "\x1B[1;31merror:\x1B[0m " << message << "\n";
+    std::exit(1);
+}
+
+void check_pg(PGconn* connection, PGresult* result, ExecStatusType expected = PGRES_COMMAND_OK) {
+    if (PQresultStatus(result) != expected) {
         std::cerr << "\x1B[1;31merror:\x1B[0m postgres error\n\x1B[1;33mdetails:\x1B[0m\n" << PQerrorMessage(connection);
         PQclear(result);
         std::exit(1);
@@ -15,9 +60,243 @@ void check_pg(PGconn* connection, PGresult* result) {
     PQclear(result);
 }
 
+std::string trim(std::string_view str) {
+    auto is_space = [](char chr) { return std::isspace(static_cast<unsigned char>(chr)) != 0; };
+    while (!str.empty() && is_space(str.front()))
+        str.remove_prefix(1);
+    while (!str.empty() && is_space(str.back()))
+        str.remove_suffix(1);
+    return std::string(str);
+}
+
+void replace_all(std::string& str, const std::string& from, const std::string& to) {
+    if (from.empty())
+        return;
+    for (size_t pos = str.find(from); pos != std::string::npos; pos = str.find(from, pos + to.size()))
+        str.replace(pos, from.size(), to);
+}
+
+std::pair<std::string, std::string> split_assignment(const std::string& line, const std::string& path, int line_no) {
+    size_t eq = line.find('=');
+    if (eq == std::string::npos)
+        fail(path + ":" + std::to_string(line_no) + ": expected '<key> = <value>'");
+    return { trim(std::string_view(line).substr(0, eq)), trim(std::string_view(line).substr(eq + 1)) };
+}
+
+ImportConfig parse_config(const std::string& path) {
+    std::ifstream file(path);
+    if (!file)
+        fail("could not open config file '" + path + "'");
+
+    ImportConfig config;
+    std::string section;
+    Replacement replacement_section;
+    std::string line;
+
+    for (int line_no = 1; std::getline(file, line); line_no++) {
+        line = trim(line);
+        if (line.empty() || line[0] == '#' || line[0] == ';')
+            continue;
+
+        if (line.front() == '[' && line.back() == ']') {
+            std::string header = trim(std::string_view(line).substr(1, line.size() - 2));
+            size_t space = header.find(' ');
+            section = header.substr(0, space);
+            replacement_section = Replacement();
+            // [replace <column> = <value>] limits the replacements to rows with the given value in the column.
+            if (section == "replace" && space != std::string::npos) {
+                auto [column, value] = split_assignment(header.substr(space + 1), path, line_no);
+                replacement_section.condition_column = column;
+                replacement_section.condition_value = value;
+            }
+            continue;
+        }
+
+        auto [key, value] = split_assignment(line, path, line_no);
+        if (section == "fasta" && key == "header_cut") {
+            config.header_cut = value.empty() ? '\0' : value[0];
+        } else if (section == "metadata" && key == "key") {
+            config.key_column = value;
+        } else if (section == "metadata" && key == "delimiter") {
+            config.delimiter = value == "tab" ? '\t' : value[0];
+        } else if (section == "metadata" && key == "strict") {
+            if (value != "yes" && value != "no")
+                fail(path + ":" + std::to_string(line_no) + ": strict must be 'yes' or 'no'");
+            config.strict = value == "yes";
+        } else if (section == "metadata" && key == "null") {
+            config.null_values.clear();
+            size_t begin = 0;
+            while ((begin = value.find_first_not_of(' ', begin)) != std::string::npos) {
+                size_t end = value.find(' ', begin);
+                config.null_values.push_back(value.substr(begin, end - begin));
+                begin = end;
+            }
+        } else if (section == "replace") {
+            Replacement replacement = replacement_section;
+            replacement.from = key;
+            replacement.to = value;
+            config.replacements.push_back(replacement);
+        } else if (section == "columns") {
+            size_t space = value.find(' ');
+            std::string transform = space == std::string::npos ? "text" : trim(value.substr(space + 1));
+            if (transform != "text" && transform != "date" && transform != "age" && transform != "country_code")
+                fail(path + ":" + std::to_string(line_no) + ": unknown transform '" + transform + "'");
+            config.columns.push_back({ key, value.substr(0, space), transform });
+        } else if (section == "country_codes") {
+            config.country_codes[key] = value;
+        } else {
+            fail(path + ":" + std::to_string(line_no) + ": unexpected '" + key + "' in section [" + section + "]");
+        }
+    }
+
+    return config;
+}
+
+// Reads one RFC 4180 record, which may span several lines if a quoted field contains a newline.
+bool read_csv_row(std::istream& input, char delimiter, std::vector<std::string>& fields) {
+    std::string line;
+    if (!std::getline(input, line))
+        return false;
+
+    fields.assign(1, "");
+    bool quoted = false;
+    for (size_t i = 0; ; i++) {
+        if (i == line.size()) {
+            if (!quoted || !std::getline(input, line))
+                break;
+            fields.back() += '\n';
+            i = static_cast<size_t>(-1);
+            continue;
+        }
+
+        char chr = line[i];
+        if (quoted && chr == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+            fields.back() += '"';
+            i++;
+        } else if (chr == '"') {
+            quoted = !quoted;
+        } else if (!quoted && chr == delimiter) {
+            fields.emplace_back();
+        } else if (chr != '\r' || quoted) {
+            fields.back() += chr;
+        }
+    }
+
+    return true;
+}
+
+bool is_valid_date(const std::string& value) {
+    // Inexact dates (2020, 2020-07) are rejected.
+    constexpr std::string_view pattern = "dddd-dd-dd";
+    return value.size() == pattern.size() && std::equal(pattern.begin(), pattern.end(), value.begin(), [](char p, char c) {
+        return p == 'd' ? std::isdigit(static_cast<unsigned char>(c)) != 0 : p == c;
+    });
+}
+
+std::optional<std::string> transform_value(const std::string& value, const ColumnMapping& column,
+        const ImportConfig& config) {
+    if (value.empty() || std::find(config.null_values.begin(), config.null_values.end(), value) != config.null_values.end())
+        return std::nullopt;
+
+    if (column.transform == "date")
+        return is_valid_date(value) ? std::optional(value) : std::nullopt;
+
+    if (column.transform == "age") {
+        // Age ranges (60 - 65, > 18, < 18) are rejected, and bare numbers are in years.
+        if (value.find_first_of("-<>") != std::string::npos)
+            return std::nullopt;
+        if (std::all_of(value.begin(), value.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); }))
+            return value + " years";
+        return value;
+    }
+
+    if (column.transform == "country_code") {
+        auto code = config.country_codes.find(value);
+        if (code == config.country_codes.end())
+            fail("missing country code for '" + value + "'");
+        return code->second;
+    }
+
+    return value;
+}
+
+size_t column_index(const std::vector<std::string>& header, const std::string& name, const std::string& path) {
+    auto it = std::find(header.begin(), header.end(), name);
+    if (it == header.end())
+        fail("missing column '" + name + "' in '" + path + "'");
+    return it - header.begin();
+}
+
+// Builds the build side of the join: metadata rows keyed by the normalized key column, with values already mapped to
+// the table columns.
+std::unordered_map<std::string, MetadataRow> load_metadata(const std::string& path, const ImportConfig& config) {
+    std::ifstream file(path);
+    if (!file)
+        fail("could not open metadata file '" + path + "'");
+
+    std::vector<std::string> header;
+    if (!read_csv_row(file, config.delimiter, header))
+        fail("empty metadata file '" + path + "'");
+
+    size_t key_index = column_index(header, config.key_column, path);
+    std::vector<size_t> source_indices;
+    for (const ColumnMapping& column : config.columns)
+        source_indices.push_back(column_index(header, column.source, path));
+    std::vector<size_t> condition_indices;
+    for (const Replacement& replacement : config.replacements) {
+        condition_indices.push_back(replacement.condition_column.empty()
+                ? header.size()
+                : column_index(header, replacement.condition_column, path));
+    }
+
+    std::unordered_map<std::string, MetadataRow> metadata;
+    std::vector<std::string> fields;
+    size_t duplicates = 0;
+    while (read_csv_row(file, config.delimiter, fields)) {
+        if (fields.size() != header.size())
+            fail("row with " + std::to_string(fields.size()) + " fields in '" + path + "'");
+
+        std::string key = fields[key_index];
+        for (size_t i = 0; i < config.replacements.size(); i++) {
+            const Replacement& replacement = config.replacements[i];
+            if (condition_indices[i] == header.size() || fields[condition_indices[i]] == replacement.condition_value)
+                replace_all(key, replacement.from, replacement.to);
+        }
+
+        MetadataRow row;
+        for (size_t i = 0; i < config.columns.size(); i++)
+            row.push_back(transform_value(fields[source_indices[i]], config.columns[i], config));
+
+        if (!metadata.insert_or_assign(std::move(key), std::move(row)).second)
+            duplicates++;
+    }
+
+    if (duplicates > 0)
+        std::cerr << "\x1B[1;33mwarning:\x1B[0m " << duplicates << " duplicate keys in metadata, the last row was kept\n";
+
+    return metadata;
+}
+
+void append_copy_value(std::string& buffer, const std::optional<std::string>& value) {
+    if (!value.has_value()) {
+        buffer += "\\N";
+        return;
+    }
+
+    for (char chr : *value) {
+        switch (chr) {
+            case '\\': buffer += "\\\\"; break;
+            case '\n': buffer += "\\n"; break;
+            case '\r': buffer += "\\r"; break;
+            case '\t': buffer += "\\t"; break;
+            default: buffer += chr;
+        }
+    }
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 5) {
-        std::cerr << "\x1B[1;31merror:\x1B[0m invalid command-line arguments\n\x1B[1;34musage:\x1B[0m " << argv[0] << " <TABLE> <NAME COLUMN> <SEQUENCE COLUMN> <FASTA FILE> <POSTGRES URL>\n";
+    if (argc != 5 && argc != 7) {
+        std::cerr << "\x1B[1;31merror:\x1B[0m invalid command-line arguments\n\x1B[1;34musage:\x1B[0m " << argv[0] << " <TABLE> <NAME COLUMN> <SEQUENCE COLUMN> <FASTA FILE> [<METADATA CSV> <CONFIG FILE>]\n";
         return 1;
     }
 
@@ -32,8 +311,18 @@ int main(int argc, char* argv[]) {
     std::string_view fasta_file_path = argv[4];
     std::string_view postgres_url = std::getenv("DB_URI");
 
+    ImportConfig config;
+    std::unordered_map<std::string, MetadataRow> metadata;
+    if (argc == 7) {
+        config = parse_config(argv[6]);
+        std::cout << "loading metadata" << std::endl;
+        metadata = load_metadata(argv[5], config);
+    }
+
     std::cout << "opening fasta file" << std::endl;
     std::ifstream fasta_file(fasta_file_path.data());
+    if (!fasta_file)
+        fail("could not open fasta file '" + std::string(fasta_file_path) + "'");
 
     std::cout << "connecting to postgres instance" << std::endl;
     PGconn* connection = PQconnectdb(postgres_url.data());
@@ -45,15 +334,51 @@ int main(int argc, char* argv[]) {
 
     check_pg(connection, PQexec(connection, "BEGIN;"));
 
+    std::string copy_query = std::string("COPY ") + table.data() + "(" + column_name.data() + ", " + column_sequence.data();
+    for (const ColumnMapping& column : config.columns)
+        copy_query += ", " + column.target;
+    copy_query += ") FROM STDIN;";
+
+    std::string batch;
+    size_t batch_size = 0;
+    size_t sequences = 0;
+    size_t unmatched = 0;
+    std::unordered_map<const MetadataRow*, size_t> row_matches;
+    auto flush_batch = [&]{
+        if (batch_size == 0)
+            return;
+        std::cout << "copying " << batch_size << " sequences [" << batch.size() << " bytes]\n";
+        check_pg(connection, PQexec(connection, copy_query.c_str()), PGRES_COPY_IN);
+        if (PQputCopyData(connection, batch.data(), batch.size()) != 1 || PQputCopyEnd(connection, nullptr) != 1)
+            fail(std::string("postgres error\n") + PQerrorMessage(connection));
+        check_pg(connection, PQgetResult(connection));
+        batch.clear();
+        batch_size = 0;
+    };
+
     std::string current_name;
     std::string current_sequence;
     std::string current_line;
-    std::string insert_query = std::string("INSERT INTO ") + table.data() + "(" + column_name.data() + ", " + column_sequence.data() + ") VALUES ($1, $2);";
     auto try_submit_sequence = [&]{
         if (current_sequence.length() > 0) {
-            std::cout << "inserting sequence '" << current_name << "' [" << current_sequence.length() << " bytes]\n";
-            const char* params[2] = {current_name.c_str(), current_sequence.c_str()};
-            check_pg(connection, PQexecParams(connection, insert_query.c_str(), 2, nullptr, params, nullptr, nullptr, 1));
+            append_copy_value(batch, current_name);
+            batch += '\t';
+            append_copy_value(batch, current_sequence);
+
+            auto row = metadata.find(current_name);
+            if (row != metadata.end())
+                row_matches[&row->second]++;
+            else if (!config.columns.empty())
+                unmatched++;
+            for (size_t i = 0; i < config.columns.size(); i++) {
+                batch += '\t';
+                append_copy_value(batch, row != metadata.end() ? row->second[i] : std::nullopt);
+            }
+            batch += '\n';
+
+            sequences++;
+            if (++batch_size >= batch_rows || batch.size() >= batch_bytes)
+                flush_batch();
             current_sequence.clear();
         }
         current_name.clear();
@@ -62,6 +387,8 @@ int main(int argc, char* argv[]) {
         if (!current_line.empty() && current_line[0] == '>') {
             try_submit_sequence();
             current_name = current_line.substr(1);
+            if (size_t cut = current_name.find(config.header_cut); config.header_cut != '\0' && cut != std::string::npos)
+                current_name.resize(cut);
         } else {
             for (char& chr : current_line)
                 chr = (char) std::toupper(chr);
@@ -69,8 +396,33 @@ int main(int argc, char* argv[]) {
         }
     }
     try_submit_sequence();
+    flush_batch();
+
+    // Failing before the commit rolls back the whole import.
+    size_t missing = 0, ambiguous = 0;
+    std::string example;
+    for (const auto& [key, row] : metadata) {
+        auto matches = row_matches.find(&row);
+        size_t count = matches != row_matches.end() ? matches->second : 0;
+        if (count == 1)
+            continue;
+        (count == 0 ? missing : ambiguous)++;
+        if (example.empty())
+            example = key;
+    }
+    if (missing + ambiguous > 0) {
+        std::string message = std::to_string(missing) + " metadata rows without a sequence and "
+                + std::to_string(ambiguous) + " matching several sequences, e.g. '" + example + "'";
+        if (config.strict)
+            fail(message + ", set strict = no in [metadata] to import them anyway");
+        std::cerr << "\x1B[1;33mwarning:\x1B[0m " << message << "\n";
+    }
 
     check_pg(connection, PQexec(connection, "COMMIT;"));
 
+    std::cout << "imported " << sequences << " sequences\n";
+    if (unmatched > 0)
+        std::cerr << "\x1B[1;33mwarning:\x1B[0m " << unmatched << " sequences without metadata\n";
+
     PQfinish(connection);
 }
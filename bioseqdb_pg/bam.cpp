@@ -0,0 +1,294 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <string>
+#include <unistd.h>
+
+#include "bam.h"
+#include "sequence.h"
+
+inline namespace {
+
+template<typename T>
+void append_raw(std::vector<uint8_t>& data, const T& value) {
+    const auto bytes = reinterpret_cast<const uint8_t*>(&value);
+    data.insert(data.end(), bytes, bytes + sizeof(T));
+}
+
+void append_int_tag(std::vector<uint8_t>& data, const char tag[2], int32_t value) {
+    data.push_back(tag[0]);
+    data.push_back(tag[1]);
+    data.push_back('i');
+    append_raw(data, value);
+}
+
+// Unmapped records have tid -1 and go last in coordinate order.
+bool coordinate_less(const bam1_t* a, const bam1_t* b) {
+    auto key = [](const bam1_t* r) { return std::make_pair(static_cast<uint32_t>(r->core.tid), r->core.pos); };
+    return key(a) < key(b);
+}
+
+}
+
+BamWriter::BamWriter(const char* path, const char* mode, unsigned threads, bool sorted, size_t sort_memory,
+        std::string run_prefix):
+    file(sam_open(path, mode)), header(nullptr), sorted(sorted), buffered(), buffered_bytes(0), sort_memory(sort_memory),
+    run_prefix(std::move(run_prefix)), runs(), records(0), reverse_query(), error_message() {
+    if (file == nullptr)
+        return;
+    if (threads > 1)
+        hts_set_threads(file, threads);
+    // References are not available as FASTA files, so CRAM stores the bases of every record.
+    hts_set_opt(file, CRAM_OPT_NO_REF, 1);
+}
+
+BamWriter::~BamWriter() {
+    abort();
+    if (header != nullptr)
+        bam_hdr_destroy(header);
+}
+
+void BamWriter::abort() {
+    for (bam1_t* record : buffered)
+        bam_destroy1(record);
+    buffered.clear();
+    buffered_bytes = 0;
+    remove_runs();
+    if (file != nullptr)
+        sam_close(file);
+    file = nullptr;
+}
+
+void BamWriter::remove_runs() {
+    for (const std::string& run : runs)
+        unlink(run.c_str());
+    runs.clear();
+}
+
+bool BamWriter::fail(const std::string& message) {
+    if (error_message.empty())
+        error_message = message;
+    return false;
+}
+
+bool BamWriter::write_header(const BwaIndex& index) {
+    std::string text = sorted ? "@HD\tVN:1.6\tSO:coordinate\n" : "@HD\tVN:1.6\tSO:unsorted\n";
+    for (size_t i = 0; i < index.reference_count(); i++) {
+        text += "@SQ\tSN:" + std::to_string(index.reference_id(i));
+        text += "\tLN:" + std::to_string(index.reference_len(i)) + "\n";
+    }
+    text += "@PG\tID:bioseqdb\tPN:bioseqdb\n";
+
+    header = sam_hdr_parse(text.size(), text.c_str());
+    if (header == nullptr)
+        return fail("could not build the header");
+    // Older htslib versions only parse the references, and write the header text as it is stored.
+    if (header->text == nullptr) {
+        header->l_text = text.size();
+        header->text = strdup(text.c_str());
+    }
+
+    if (sam_hdr_write(file, header) < 0)
+        return fail("could not write the header");
+    return true;
+}
+
+bam1_t* BamWriter::build_record(int64_t query_id, std::string_view query, const BwaRecord* match, bool supplementary) {
+    const std::string qname = std::to_string(query_id);
+    std::string_view seq = query;
+
+    // Like bwa, reverse strand records store the reverse complement of the query.
+    if (match != nullptr && match->is_reverse) {
+        reverse_query.resize(query.size());
+        std::transform(query.rbegin(), query.rend(), reverse_query.begin(), complement_symbol);
+        seq = reverse_query;
+    }
+
+    std::vector<uint8_t> data;
+    data.insert(data.end(), qname.c_str(), qname.c_str() + qname.size() + 1);
+    if (match != nullptr) {
+        for (uint32_t op : match->cigar_ops)
+            append_raw(data, op);
+    }
+    for (size_t i = 0; i < seq.size(); i += 2) {
+        uint8_t high = seq_nt16_table[static_cast<uint8_t>(seq[i])];
+        uint8_t low = i + 1 < seq.size() ? seq_nt16_table[static_cast<uint8_t>(seq[i + 1])] : 0;
+        data.push_back(high << 4 | low);
+    }
+    // Sequences carry no base qualities.
+    data.insert(data.end(), seq.size(), 0xff);
+    if (match != nullptr) {
+        append_int_tag(data, "NM", match->edit_distance);
+        append_int_tag(data, "AS", match->score);
+    }
+
+    bam1_t* record = bam_init1();
+    record->data = static_cast<uint8_t*>(malloc(data.size()));
+    std::copy(data.begin(), data.end(), record->data);
+    record->l_data = data.size();
+    record->m_data = data.size();
+
+    record->core.l_qname = qname.size() + 1;
+    record->core.l_qseq = seq.size();
+    record->core.mtid = -1;
+    record->core.mpos = -1;
+    record->core.isize = 0;
+
+    if (match == nullptr) {
+        record->core.tid = -1;
+        record->core.pos = -1;
+        record->core.bin = hts_reg2bin(-1, 0, 14, 5);
+        record->core.qual = 0;
+        record->core.flag = BAM_FUNMAP;
+        record->core.n_cigar = 0;
+        return record;
+    }
+
+    const uint32_t* cigar = match->cigar_ops.data();
+    const int64_t end = match->ref_pos + bam_cigar2rlen(match->cigar_ops.size(), cigar);
+    record->core.tid = match->ref_index;
+    record->core.pos = match->ref_pos;
+    record->core.bin = hts_reg2bin(match->ref_pos, end, 14, 5);
+    record->core.qual = match->mapq;
+    record->core.flag = (match->is_secondary ? BAM_FSECONDARY : 0) | (supplementary ? BAM_FSUPPLEMENTARY : 0)
+            | (match->is_reverse ? BAM_FREVERSE : 0);
+    record->core.n_cigar = match->cigar_ops.size();
+    return record;
+}
+
+bool BamWriter::write_record(bam1_t* record) {
+    records++;
+    if (sorted) {
+        buffered.push_back(record);
+        buffered_bytes += sizeof(bam1_t) + record->m_data;
+        return buffered_bytes <= sort_memory || spill_run();
+    }
+
+    int ret = sam_write1(file, header, record);
+    bam_destroy1(record);
+    return ret >= 0 || fail("could not write a record");
+}
+
+bool BamWriter::write_query(int64_t query_id, std::string_view query, const std::vector<BwaRecord>& matches,
+        int min_score) {
+    const BwaRecord* primary = nullptr;
+    for (const BwaRecord& match : matches) {
+        if (match.score >= min_score && !match.is_secondary && (primary == nullptr || match.score > primary->score))
+            primary = &match;
+    }
+
+    if (primary == nullptr)
+        return write_record(build_record(query_id, query, nullptr, false));
+
+    for (const BwaRecord& match : matches) {
+        if (match.score < min_score)
+            continue;
+        if (!write_record(build_record(query_id, query, &match, !match.is_secondary && &match != primary)))
+            return false;
+    }
+    return true;
+}
+
+// Writes the buffered records sorted to a new run. Runs only have to be read back, so they are compressed lightly.
+bool BamWriter::spill_run() {
+    std::stable_sort(buffered.begin(), buffered.end(), coordinate_less);
+
+    std::string path = run_prefix + "." + std::to_string(runs.size()) + ".bam";
+    samFile* run = sam_open(path.c_str(), "wb1");
+    if (run == nullptr)
+        return fail("could not create file \"" + path + "\"");
+    runs.push_back(path);
+
+    bool ok = sam_hdr_write(run, header) >= 0;
+    for (bam1_t* record : buffered) {
+        ok = ok && sam_write1(run, header, record) >= 0;
+        bam_destroy1(record);
+    }
+    buffered.clear();
+    buffered_bytes = 0;
+
+    if (sam_close(run) < 0 || !ok)
+        return fail("could not write file \"" + path + "\"");
+    return true;
+}
+
+// Merges the runs into the output file. Among equal positions, records of earlier runs go first, so that the order is
+// the same as if all records were sorted at once.
+bool BamWriter::merge_runs() {
+    struct Head {
+        bam1_t* record;
+        size_t run;
+    };
+    auto later = [](const Head& a, const Head& b) {
+        return coordinate_less(b.record, a.record) || (!coordinate_less(a.record, b.record) && a.run > b.run);
+    };
+    std::priority_queue<Head, std::vector<Head>, decltype(later)> heads(later);
+    std::vector<samFile*> files;
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        samFile* run = sam_open(runs[i].c_str(), "r");
+        bam_hdr_t* run_header = run != nullptr ? sam_hdr_read(run) : nullptr;
+        if (run_header == nullptr) {
+            if (run != nullptr)
+                sam_close(run);
+            fail("could not read file \"" + runs[i] + "\"");
+            break;
+        }
+        bam_hdr_destroy(run_header);
+        files.push_back(run);
+
+        bam1_t* record = bam_init1();
+        if (sam_read1(run, header, record) >= 0)
+            heads.push({ record, i });
+        else
+            bam_destroy1(record);
+    }
+
+    while (!heads.empty()) {
+        Head head = heads.top();
+        heads.pop();
+
+        if (error_message.empty() && sam_write1(file, header, head.record) < 0)
+            fail("could not write a record");
+
+        int ret = error_message.empty() ? sam_read1(files[head.run], header, head.record) : -1;
+        if (ret >= 0)
+            heads.push(head);
+        else
+            bam_destroy1(head.record);
+        if (ret < -1)
+            fail("could not read file \"" + runs[head.run] + "\"");
+    }
+
+    for (samFile* run : files)
+        sam_close(run);
+    remove_runs();
+    return error_message.empty();
+}
+
+bool BamWriter::close() {
+    if (file == nullptr)
+        return error_message.empty();
+
+    if (sorted && !runs.empty()) {
+        if (!buffered.empty())
+            spill_run();
+        if (error_message.empty())
+            merge_runs();
+        remove_runs();
+    } else if (sorted) {
+        std::stable_sort(buffered.begin(), buffered.end(), coordinate_less);
+        for (bam1_t* record : buffered) {
+            if (error_message.empty() && sam_write1(file, header, record) < 0)
+                fail("could not write a record");
+            bam_destroy1(record);
+        }
+        buffered.clear();
+    }
+
+    if (sam_close(file) < 0)
+        fail("could not finish the file");
+    file = nullptr;
+    return error_message.empty();
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <htslib/htslib/sam.h>
+
+#include "bwa.h"
+
+// Writes alignments as SAM, BAM or CRAM records, named by query ids and placed on references named by reference ids.
+// It does not call into Postgres, instead failures are reported through error().
+class BamWriter {
+public:
+    // mode is a htslib mode string, e.g. "wb" for BAM or "wc" for CRAM. Compression runs on the given number of
+    // threads. Sorted output is buffered in memory up to sort_memory bytes, beyond which the records are sorted and
+    // spilled to temporary BAM files named by run_prefix, and these runs are merged by close().
+    BamWriter(const char* path, const char* mode, unsigned threads, bool sorted, size_t sort_memory,
+            std::string run_prefix);
+    ~BamWriter();
+
+    bool is_open() const { return file != nullptr; }
+    bool write_header(const BwaIndex& index);
+    // Writes the matches of a query scoring at least min_score, or an unmapped record if there are none. Like in bwa, the
+    // best match which is not secondary is the primary one, and other such matches are supplementary, being the parts
+    // of a chimeric or split alignment.
+    bool write_query(int64_t query_id, std::string_view query, const std::vector<BwaRecord>& matches, int min_score);
+    bool close();
+    // Closes the file without writing buffered records, and removes the runs, after an error.
+    void abort();
+
+    const std::string& error() const { return error_message; }
+    size_t records_written() const { return records; }
+
+private:
+    bam1_t* build_record(int64_t query_id, std::string_view query, const BwaRecord* match, bool supplementary);
+    bool write_record(bam1_t* record);
+    bool spill_run();
+    bool merge_runs();
+    void remove_runs();
+    bool fail(const std::string& message);
+
+    samFile* file;
+    bam_hdr_t* header;
+    bool sorted;
+    std::vector<bam1_t*> buffered;
+    size_t buffered_bytes;
+    size_t sort_memory;
+    std::string run_prefix;
+    std::vector<std::string> runs;
+    size_t records;
+    std::string reverse_query;
+    std::string error_message;
+};
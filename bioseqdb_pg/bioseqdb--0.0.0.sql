@@ -28,6 +28,16 @@ CREATE FUNCTION nuclseq_content(NUCLSEQ, CSTRING)
     AS 'MODULE_PATHNAME'
     LANGUAGE C IMMUTABLE STRICT;
 
+CREATE FUNCTION nuclseq_gc(NUCLSEQ)
+    RETURNS DOUBLE PRECISION
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION nuclseq_n_fraction(NUCLSEQ)
+    RETURNS DOUBLE PRECISION
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT;
+
 CREATE FUNCTION nuclseq_complement(NUCLSEQ)
     RETURNS NUCLSEQ
     AS 'MODULE_PATHNAME'
@@ -38,6 +48,77 @@ CREATE FUNCTION nuclseq_reverse(NUCLSEQ)
     AS 'MODULE_PATHNAME'
     LANGUAGE C IMMUTABLE STRICT;
 
+CREATE TYPE PROTSEQ;
+
+CREATE FUNCTION protseq_in(CSTRING)
+    RETURNS PROTSEQ
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION protseq_out(PROTSEQ)
+    RETURNS CSTRING
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION protseq_recv(INTERNAL)
+    RETURNS PROTSEQ
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION protseq_send(PROTSEQ)
+    RETURNS BYTEA
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE TYPE protseq (
+    internallength = VARIABLE,
+    storage = EXTENDED,
+    input = protseq_in,
+    output = protseq_out,
+    receive = protseq_recv,
+    send = protseq_send
+);
+
+CREATE FUNCTION protseq_len(PROTSEQ)
+    RETURNS INTEGER
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION nuclseq_translate(seq NUCLSEQ, frame INTEGER DEFAULT 1, code INTEGER DEFAULT 1)
+    RETURNS PROTSEQ
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE TYPE translation AS (
+    frame INTEGER,
+    seq PROTSEQ
+);
+
+CREATE FUNCTION nuclseq_translate_frames(seq NUCLSEQ, code INTEGER DEFAULT 1)
+    RETURNS SETOF translation
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION nuclseq_hamming(a NUCLSEQ, b NUCLSEQ, max_dist INTEGER DEFAULT 2147483647)
+    RETURNS INTEGER
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION nuclseq_edit_distance(a NUCLSEQ, b NUCLSEQ, max_dist INTEGER DEFAULT 2147483647)
+    RETURNS INTEGER
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE TYPE edit_match AS (
+    distance INTEGER,
+    match_end INTEGER
+);
+
+CREATE FUNCTION nuclseq_edit_search(pattern NUCLSEQ, seq NUCLSEQ, max_dist INTEGER DEFAULT 2147483647)
+    RETURNS edit_match
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT;
+
 CREATE TYPE bwa_options AS (
 	min_seed_len INTEGER,
 	max_occ INTEGER,
@@ -50,7 +131,8 @@ CREATE TYPE bwa_options AS (
 	o_del INTEGER,
 	e_del INTEGER,
 	o_ins INTEGER,
-	e_ins INTEGER
+	e_ins INTEGER,
+	reference_len_hint INTEGER
 );
 
 CREATE FUNCTION bwa_opts(
@@ -65,20 +147,21 @@ CREATE FUNCTION bwa_opts(
 	o_del INTEGER DEFAULT 6,
 	o_ins INTEGER DEFAULT 6,
 	e_del INTEGER DEFAULT 1,
-	e_ins INTEGER DEFAULT 1
+	e_ins INTEGER DEFAULT 1,
+	reference_len_hint INTEGER DEFAULT 0
 ) RETURNS bwa_options AS $$ 
 	SELECT ROW(
 		min_seed_len, max_occ, match_score, mismatch_penalty,
 		pen_clip3, pen_clip5, zdrop, bandwidth,
-		o_del, o_ins, e_del, e_ins
+		o_del, o_ins, e_del, e_ins, reference_len_hint
 	) as opts
 $$ LANGUAGE SQL IMMUTABLE STRICT;
 
 CREATE TYPE bwa_result AS (
     ref_id BIGINT,
     ref_subseq NUCLSEQ,
-    ref_match_start INTEGER,
-    ref_match_end INTEGER,
+    ref_match_start BIGINT,
+    ref_match_end BIGINT,
     ref_match_len INTEGER,
     query_id BIGINT,
     query_subseq NUCLSEQ,
@@ -101,3 +184,119 @@ CREATE FUNCTION nuclseq_multi_search_bwa(query_sql CSTRING, reference_sql CSTRIN
     RETURNS SETOF bwa_result
     AS 'MODULE_PATHNAME'
     LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION nuclseq_multi_search_bwa_sharded(
+	query_sql CSTRING,
+	reference_sql CSTRING,
+	shards INTEGER,
+	opts bwa_options DEFAULT bwa_opts()
+) RETURNS SETOF bwa_result
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION nuclseq_merge_bwa_results(results_sql CSTRING, mask_level DOUBLE PRECISION DEFAULT 0.5)
+    RETURNS SETOF bwa_result
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STABLE STRICT;
+
+CREATE FUNCTION nuclseq_search_bwa_to_bam(
+	query_sql CSTRING,
+	reference_sql CSTRING,
+	path TEXT,
+	opts bwa_options DEFAULT bwa_opts(),
+	format TEXT DEFAULT 'bam',
+	sorted BOOLEAN DEFAULT false,
+	threads INTEGER DEFAULT 0
+) RETURNS BIGINT
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE TYPE distance_result AS (
+    id_a BIGINT,
+    id_b BIGINT,
+    dist INTEGER
+);
+
+CREATE FUNCTION nuclseq_distance_matrix(sql CSTRING, max_dist INTEGER DEFAULT 2147483647, threads INTEGER DEFAULT 0)
+    RETURNS SETOF distance_result
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STABLE STRICT;
+
+CREATE TYPE edit_search_result AS (
+    id BIGINT,
+    distance INTEGER,
+    match_end INTEGER
+);
+
+CREATE FUNCTION nuclseq_edit_search_table(pattern NUCLSEQ, sql CSTRING, max_dist INTEGER, threads INTEGER DEFAULT 0)
+    RETURNS SETOF edit_search_result
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STABLE STRICT;
+
+CREATE TYPE cluster_options AS (
+	kmer_len INTEGER,
+	sketch_size INTEGER,
+	max_candidates INTEGER,
+	threads INTEGER
+);
+
+CREATE FUNCTION cluster_opts(
+	kmer_len INTEGER DEFAULT 16,
+	sketch_size INTEGER DEFAULT 128,
+	max_candidates INTEGER DEFAULT 16,
+	threads INTEGER DEFAULT 0
+) RETURNS cluster_options AS $$
+	SELECT ROW(kmer_len, sketch_size, max_candidates, threads) as opts
+$$ LANGUAGE SQL IMMUTABLE STRICT;
+
+CREATE TYPE cluster_result AS (
+    id BIGINT,
+    cluster_id BIGINT,
+    is_representative BOOLEAN,
+    identity DOUBLE PRECISION
+);
+
+CREATE FUNCTION nuclseq_cluster(sql CSTRING, identity DOUBLE PRECISION, opts cluster_options DEFAULT cluster_opts())
+    RETURNS SETOF cluster_result
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STABLE STRICT;
+
+CREATE TYPE fasta_record AS (
+    id BIGINT,
+    name TEXT,
+    seq NUCLSEQ,
+    quality TEXT
+);
+
+CREATE FUNCTION nuclseq_read_fasta_support(INTERNAL)
+    RETURNS INTERNAL
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION nuclseq_read_fasta(path TEXT, threads INTEGER DEFAULT 0)
+    RETURNS SETOF fasta_record
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C VOLATILE STRICT
+    SUPPORT nuclseq_read_fasta_support;
+
+CREATE TYPE fasta_chunk AS (
+    id BIGINT,
+    name TEXT,
+    chunk_offset BIGINT,
+    seq NUCLSEQ
+);
+
+CREATE FUNCTION nuclseq_read_fasta_chunked(path TEXT, chunk_len INTEGER DEFAULT 16777216, threads INTEGER DEFAULT 0)
+    RETURNS SETOF fasta_chunk
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE TYPE nuclseq_chunk AS (
+    chunk_offset BIGINT,
+    seq NUCLSEQ
+);
+
+CREATE FUNCTION nuclseq_split(seq NUCLSEQ, chunk_len INTEGER)
+    RETURNS SETOF nuclseq_chunk
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT;
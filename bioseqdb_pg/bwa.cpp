@@ -1,13 +1,23 @@
 #include <algorithm>
 #include <cassert>
+#include <climits>
 #include <cstring>
 #include <cstdint>
+#include <new>
+#include <numeric>
+#include <utility>
+#include <unistd.h>
 
 #include <htslib/htslib/sam.h>
 extern "C" {
 #include <bwa/bwt.h>
-// Internal libbwa symbol, not exported through any of the headers.
+#include <common/file_utils.h>
+#include <miscadmin.h>
+#include <storage/fd.h>
+#include <utils/memutils.h>
+// Internal libbwa symbols, not exported through any of the headers.
 int is_bwt(ubyte_t *T, int n);
+void bwt_bwtgen2(const char *fn_pac, const char *fn_bwt, int block_size);
 }
 
 #include "bwa.h"
@@ -16,40 +26,15 @@ int is_bwt(ubyte_t *T, int n);
 #define raise_pg_error(code, msg) ereport(ERROR, (errcode(code)), msg);
 
 inline namespace {
-    // Modifined version of original bwa implementaion adjusted to our requirements.
-    bwt_t* pac2bwt(const std::vector<ubyte_t>& pac_forward) {
-        const ubyte_t* pac = pac_forward.data();
-        size_t pac_len = pac_forward.size() * 4;
-
-        // Calloc here is needed.
-        bwt_t* bwt = (bwt_t*) calloc(1, sizeof(bwt_t));
-        bwt->seq_len = pac_len * 2;
-        bwt->bwt_size = (bwt->seq_len + 15) >> 4;
-
-        ubyte_t* buf = (ubyte_t*) malloc(bwt->seq_len + 1);
-        buf[bwt->seq_len] = 0;
-
-        // TODO: optimize
-        // Forward
-        for (size_t i = 0; i < pac_len ; i++) {
-            buf[i] = pac_raw_get(pac, i);
-            bwt->L2[1 + buf[i]]++;
-            bwt->L2[4 - buf[i]]++;
-        }
-
-        // Backward complement
-        for (ssize_t i = pac_len - 1; i >= 0 ; i--)
-            buf[2 * pac_len - 1 - i] = 0b11 - pac_raw_get(pac, i);
-
-        for (int i = 2; i <= 4; ++i)
-            bwt->L2[i] += bwt->L2[i - 1];
+    // Block size of the BWT-SW algorithm, same as the default of `bwa index`.
+    constexpr int bwtsw_block_size = 10000000;
+    // References up to this many bases are always indexed in memory. `bwa index` uses the same threshold to choose
+    // between the algorithms, as BWT-SW is slower on small references, and does not work on the smallest ones.
+    constexpr size_t bwtsw_min_len = 50000000;
 
-        bwt->primary = is_bwt(buf, bwt->seq_len);
-        bwt->bwt = (u_int32_t*) calloc(bwt->bwt_size, 4);
-        for (size_t i = 0; i < bwt->seq_len; ++i)
-            bwt->bwt[i>>4] |= buf[i] << ((15 - (i & 15)) << 1);
-        free(buf);
-        return bwt;
+    ubyte_t reverse_complement_byte(ubyte_t x) {
+        x = ~x;
+        return (x & 0x03) << 6 | (x & 0x0c) << 2 | (x & 0x30) >> 2 | (x & 0xc0) >> 6;
     }
 
     std::string extract_reference_subseq(bwaidx_t* index, int64_t ref_begin, int64_t ref_end) {
@@ -67,79 +52,286 @@ inline namespace {
         return subseq;
     }
 
-    std::string cigar_compressed_to_string(const uint32_t *raw, int len) {
+    // libbwa encodes CIGAR operations as indices into "MIDSH", which differs from the BAM encoding.
+    std::vector<uint32_t> cigar_bwa_to_bam(const uint32_t *raw, int len) {
+        constexpr uint32_t bam_ops[] = { BAM_CMATCH, BAM_CINS, BAM_CDEL, BAM_CSOFT_CLIP, BAM_CHARD_CLIP };
+        std::vector<uint32_t> cigar(len);
+        for (int i = 0; i < len; ++i)
+            cigar[i] = bam_cigar_gen(bam_cigar_oplen(raw[i]), bam_ops[raw[i] & 0xf]);
+        return cigar;
+    }
+
+    std::string cigar_compressed_to_string(const std::vector<uint32_t>& ops) {
         std::string cigar;
-        for (int i = 0; i < len; ++i) {
-            cigar += std::to_string(bam_cigar_oplen(raw[i]));
-            cigar += bam_cigar_opchr(raw[i]);
+        for (uint32_t op : ops) {
+            cigar += std::to_string(bam_cigar_oplen(op));
+            cigar += bam_cigar_opchr(op);
         }
         return cigar;
     }
 }
 
-BwaIndex::BwaIndex(): index(nullptr), pac_forward(), holes(), annotations(), options(mem_opt_init()) {}
-
-void BwaIndex::add_ref_sequence(int64_t id, const NucleotideSequence& seq) {
-    int64_t offset = pac_forward.size() * 4;
-    auto& ref = annotations.emplace_back(bntann1_t {
-        .offset = offset,
-        .len = (int32_t) seq.len,
-        .n_ambs = (int32_t) seq.holes_num,
-        .gi = 0,
-        .name = reinterpret_cast<char*>(id),
-        .anno = nullptr,
+void mark_primary(std::vector<BwaMatch>& matches, float mask_level) {
+    std::vector<size_t> order(matches.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return matches[a].score > matches[b].score;
     });
 
-    // Reference sequence may be hundred of megabytes big, so we force usage of memcopy;
-    // TODO: resize initilizes data. Use something else.
-    size_t old_size = pac_forward.size();
-    pac_forward.resize(old_size + pac_byte_size(seq.len));
-    std::copy_n(seq.pac(), pac_byte_size(seq.len), pac_forward.data() + old_size);
+    std::vector<const BwaMatch*> primaries;
+    for (size_t i : order) {
+        BwaMatch& match = matches[i];
+        bool is_secondary = std::any_of(primaries.begin(), primaries.end(), [&](const BwaMatch* primary) {
+            int32_t overlap = std::min(match.query_match_end, primary->query_match_end)
+                    - std::max(match.query_match_begin, primary->query_match_begin);
+            int32_t min_len = std::min(match.query_match_end - match.query_match_begin,
+                    primary->query_match_end - primary->query_match_begin);
+            return overlap > 0 && overlap >= min_len * mask_level;
+        });
+
+        match.is_primary = !is_secondary;
+        match.is_secondary = is_secondary;
+        if (!is_secondary)
+            primaries.push_back(&match);
+    }
+}
+
+BwaIndex::BwaIndex(MemoryContext parent):
+    options(nullptr),
+    memory(AllocSetContextCreate(parent, "bwa index", ALLOCSET_DEFAULT_SIZES)),
+    resources(nullptr),
+    pac_forward(nullptr),
+    pac_size(0),
+    pac_capacity(0) {
+    resources = new (MemoryContextAlloc(memory, sizeof(Resources))) Resources();
+    resources->options = options = mem_opt_init();
+    resources->callback.func = free_resources;
+    resources->callback.arg = resources;
+    MemoryContextRegisterResetCallback(memory, &resources->callback);
+}
+
+void BwaIndex::free_resources(void* arg) {
+    // Manual deleation prevents libbwa from running free on vector.data().
+    Resources* resources = static_cast<Resources*>(arg);
+    if (resources->index != nullptr) {
+        bwt_destroy(resources->index->bwt);
+        free(resources->index->bns);
+        free(resources->index);
+    }
+    free(resources->options);
+    resources->~Resources();
+}
+
+void BwaIndex::resize_pac(size_t capacity) {
+    // Reference sequences may be hundreds of megabytes big, so the buffer is left uninitialized. It only grows when
+    // the estimate passed to reserve was too small, and is shrunk to fit before the build.
+    if (pac_forward == nullptr)
+        pac_forward = static_cast<ubyte_t*>(MemoryContextAllocHuge(memory, capacity));
+    else
+        pac_forward = static_cast<ubyte_t*>(repalloc_huge(pac_forward, capacity));
+    pac_capacity = capacity;
+}
+
+void BwaIndex::reserve(size_t pac_bytes) {
+    if (pac_bytes > pac_capacity)
+        resize_pac(pac_bytes);
+}
+
+void BwaIndex::add_ref_sequence(int64_t id, const NucleotideSequence& seq, int64_t chunk_offset) {
+    auto& annotations = resources->annotations;
+    if (chunk_offset == 0) {
+        annotations.push_back(bntann1_t {
+            .offset = static_cast<int64_t>(pac_size * 4),
+            .len = 0,
+            .n_ambs = 0,
+            .gi = 0,
+            .name = reinterpret_cast<char*>(id),
+            .anno = nullptr,
+        });
+    } else if (annotations.empty() || reference_id(annotations.size() - 1) != id || annotations.back().len != chunk_offset) {
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE,
+                errmsg("chunks of reference " INT64_FORMAT " must follow each other in order of their offsets", id));
+    }
+
+    auto& ref = annotations.back();
+    if (static_cast<int64_t>(ref.len) + seq.len > INT32_MAX) {
+        raise_pg_error(ERRCODE_PROGRAM_LIMIT_EXCEEDED,
+                errmsg("reference " INT64_FORMAT " is longer than %d nucleotides, the limit of bwa", id, INT32_MAX));
+    }
+
+    // A chunk starts right after the end of the previous one, which may be in the middle of a byte.
+    const int64_t begin = ref.offset + ref.len;
+    const size_t end_bytes = pac_byte_size(begin + seq.len);
+    if (end_bytes > pac_capacity)
+        resize_pac(std::max(end_bytes, pac_capacity * 2));
+
+    if (begin % 4 == 0) {
+        std::copy_n(seq.pac(), pac_byte_size(seq.len), pac_forward + begin / 4);
+    } else {
+        // Chunk lengths are usually multiples of 4, so this slow path is only taken for the odd ones.
+        const size_t begin_byte = begin / 4;
+        pac_forward[begin_byte] &= static_cast<ubyte_t>(0xff << (8 - 2 * (begin % 4)));
+        std::fill(pac_forward + begin_byte + 1, pac_forward + end_bytes, 0);
+        for (uint32_t i = 0; i < seq.len; i++)
+            pac_raw_set(pac_forward, begin + i, pac_raw_get(seq.pac(), i));
+    }
+    pac_size = end_bytes;
 
     // There is not so much of holes in standand genome, so nicer code is better.
-    std::transform(seq.holes(), seq.holes() + seq.holes_num, std::back_inserter(holes), [&offset](const auto& hole) {
+    auto& holes = resources->holes;
+    std::transform(seq.holes(), seq.holes() + seq.holes_num, std::back_inserter(holes), [&begin](const auto& hole) {
         bntamb1_t ret = hole;
-        ret.offset += offset;
-        return hole;
+        ret.offset += begin;
+        return ret;
     });
+    ref.len += static_cast<int32_t>(seq.len);
+    ref.n_ambs += static_cast<int32_t>(seq.holes_num);
 }
 
-void BwaIndex::build() {
-    if (pac_forward.empty())
+// Modifined version of original bwa implementaion adjusted to our requirements.
+bwt_t* BwaIndex::build_bwt_in_memory() {
+    const ubyte_t* pac = pac_forward;
+    size_t pac_len = pac_size * 4;
+
+    // The buffer is allocated first, so that nothing is malloc'd yet if Postgres runs out of memory.
+    ubyte_t* buf = static_cast<ubyte_t*>(MemoryContextAllocHuge(memory, pac_len * 2 + 1));
+
+    // Calloc here is needed.
+    bwt_t* bwt = (bwt_t*) calloc(1, sizeof(bwt_t));
+    bwt->seq_len = pac_len * 2;
+    bwt->bwt_size = (bwt->seq_len + 15) >> 4;
+    buf[bwt->seq_len] = 0;
+
+    // TODO: optimize
+    // Forward
+    for (size_t i = 0; i < pac_len ; i++) {
+        buf[i] = pac_raw_get(pac, i);
+        bwt->L2[1 + buf[i]]++;
+        bwt->L2[4 - buf[i]]++;
+    }
+
+    // Backward complement
+    for (ssize_t i = pac_len - 1; i >= 0 ; i--)
+        buf[2 * pac_len - 1 - i] = 0b11 - pac_raw_get(pac, i);
+
+    for (int i = 2; i <= 4; ++i)
+        bwt->L2[i] += bwt->L2[i - 1];
+
+    bwt->primary = is_bwt(buf, bwt->seq_len);
+    bwt->bwt = (u_int32_t*) calloc(bwt->bwt_size, 4);
+    for (size_t i = 0; i < bwt->seq_len; ++i)
+        bwt->bwt[i>>4] |= buf[i] << ((15 - (i & 15)) << 1);
+    pfree(buf);
+    return bwt;
+}
+
+// Spills both strands of the reference to a temporary file in the format written by `bwa index`, and builds the BWT
+// with the BWT-SW algorithm, which works on blocks of the text instead of a byte and a suffix array entry per base.
+bwt_t* BwaIndex::build_bwt_external() {
+    static uint32_t counter = 0;
+    char dir_path[MAXPGPATH], pac_path[MAXPGPATH], bwt_path[MAXPGPATH];
+
+    snprintf(dir_path, sizeof(dir_path), "base/%s", PG_TEMP_FILES_DIR);
+    snprintf(pac_path, sizeof(pac_path), "%s/%s%d.bwa%u.pac", dir_path, PG_TEMP_FILE_PREFIX, MyProcPid, counter);
+    snprintf(bwt_path, sizeof(bwt_path), "%s/%s%d.bwa%u.bwt", dir_path, PG_TEMP_FILE_PREFIX, MyProcPid, counter);
+    counter++;
+
+    // The directory is created lazily by Postgres itself, so it may not exist yet.
+    MakePGDirectory(dir_path);
+    FILE* file = AllocateFile(pac_path, PG_BINARY_W);
+    if (file == nullptr)
+        ereport(ERROR, (errcode_for_file_access(), errmsg("could not create file \"%s\": %m", pac_path)));
+
+    fwrite(pac_forward, 1, pac_size, file);
+
+    std::vector<ubyte_t> chunk(1 << 16);
+    for (size_t done = 0; done < pac_size; done += chunk.size()) {
+        size_t n = std::min(chunk.size(), pac_size - done);
+        for (size_t i = 0; i < n; i++)
+            chunk[i] = reverse_complement_byte(pac_forward[pac_size - 1 - done - i]);
+        fwrite(chunk.data(), 1, n, file);
+    }
+
+    // Both strands have a length divisible by 4, which `bwa index` marks with an extra zero byte, followed by the
+    // number of bases in the last byte.
+    const ubyte_t trailer[2] = {0, 0};
+    fwrite(trailer, 1, sizeof(trailer), file);
+
+    if (ferror(file) || FreeFile(file) != 0) {
+        unlink(pac_path);
+        ereport(ERROR, (errcode_for_file_access(), errmsg("could not write file \"%s\": %m", pac_path)));
+    }
+
+    bwt_bwtgen2(pac_path, bwt_path, bwtsw_block_size);
+    bwt_t* bwt = bwt_restore_bwt(bwt_path);
+
+    unlink(pac_path);
+    unlink(bwt_path);
+    return bwt;
+}
+
+void BwaIndex::build(size_t memory_budget) {
+    if (pac_size == 0)
         return;
 
-    bwt_t* bwt = pac2bwt(pac_forward);
+    // The buffer may have been reserved or grown past the references, and the rest would be kept for the whole search.
+    if (pac_capacity > pac_size)
+        resize_pac(pac_size);
+
+    const auto& holes = resources->holes;
+    const auto& annotations = resources->annotations;
+    const size_t seq_len = pac_size * 8;
+    const size_t metadata_bytes = holes.size() * sizeof(bntamb1_t) + annotations.size() * sizeof(bntann1_t);
+    // Final index: the bwt interleaved with occurrence counts, and the suffix array sampled every 32 positions.
+    const size_t index_bytes = pac_capacity + metadata_bytes + seq_len / 4 * 5 / 4 + seq_len / 32 * sizeof(bwtint_t);
+    // is_bwt takes a byte per base and an int per base for the suffix array.
+    const size_t in_memory_peak = pac_capacity + metadata_bytes + (seq_len + 1) * (1 + sizeof(int));
+    // BWT-SW keeps the packed text and the packed bwt.
+    const size_t external_peak = pac_capacity + metadata_bytes + seq_len / 2;
+
+    const bool in_memory = seq_len <= INT_MAX && (pac_size * 4 <= bwtsw_min_len || in_memory_peak <= memory_budget);
+    bwt_t* bwt = in_memory ? build_bwt_in_memory() : build_bwt_external();
     bwt_bwtupdate_core(bwt);
     bwt_cal_sa(bwt, 32);
     bwt_gen_cnt_table(bwt);
 
     bntseq_t* bns = (bntseq_t*) calloc(1, sizeof(bntseq_t));
     bns->seed = 11;
-    bns->l_pac = pac_forward.size() * 4;
+    bns->l_pac = pac_size * 4;
     bns->n_seqs = annotations.size();
-    bns->ambs = holes.data();
+    bns->ambs = resources->holes.data();
     bns->n_holes = holes.size();
-    bns->anns = annotations.data();
+    bns->anns = resources->annotations.data();
 
-    index = (bwaidx_t*) calloc(1, sizeof(bwaidx_t));
+    bwaidx_t* index = (bwaidx_t*) calloc(1, sizeof(bwaidx_t));
     index->bwt = bwt;
     index->bns = bns;
-    index->pac = pac_forward.data();
+    index->pac = pac_forward;
+    resources->index = index;
+
+    elog(DEBUG1, "built bwa index of %zu sequences (%zu bases) %s, peak memory about %zu kB",
+            annotations.size(), pac_size * 4, in_memory ? "in memory" : "with BWT-SW",
+            std::max(in_memory ? in_memory_peak : external_peak, index_bytes) / 1024);
 }
 
 
+BwaIndex::BwaIndex(BwaIndex&& other) noexcept:
+    options(std::exchange(other.options, nullptr)),
+    memory(std::exchange(other.memory, nullptr)),
+    resources(std::exchange(other.resources, nullptr)),
+    pac_forward(std::exchange(other.pac_forward, nullptr)),
+    pac_size(std::exchange(other.pac_size, 0)),
+    pac_capacity(std::exchange(other.pac_capacity, 0)) {}
+
 BwaIndex::~BwaIndex() {
-    // Manual deleation prevents libbwa from running free on vector.data().
-    if (index != nullptr) {
-        bwt_destroy(index->bwt);
-        free(index->bns);
-        free(index);
-    }
-    free(options);
+    // Deleting the context runs free_resources.
+    if (memory != nullptr)
+        MemoryContextDelete(memory);
 }
 
 std::vector<BwaMatch> BwaIndex::align_sequence(const NucleotideSequence& seq) const {
-    if(pac_forward.empty())
+    bwaidx_t* index = resources->index;
+    if(index == nullptr)
         return {};
     // bwa algorithm is mainly used with very short query sequences (< 100 symbols) so cost of to_malloc_text here
     // is minimal.
@@ -159,8 +351,8 @@ std::vector<BwaMatch> BwaIndex::align_sequence(const NucleotideSequence& seq) co
         matches.push_back({
             .ref_id = reinterpret_cast<int64_t>(index->bns->anns[align->rid].name),
             .ref_subseq = extract_reference_subseq(index, align->rb, align->re),
-            .ref_match_begin = static_cast<int32_t>(align->rb - ref_offset),
-            .ref_match_end = static_cast<int32_t>(align->re - ref_offset),
+            .ref_match_begin = align->rb - ref_offset,
+            .ref_match_end = align->re - ref_offset,
             .ref_match_len = static_cast<int32_t>(align->re - align->rb),
             .query_subseq = query.substr(align->qb, align->qe - align->qb),
             .query_match_begin = align->qb,
@@ -170,7 +362,7 @@ std::vector<BwaMatch> BwaIndex::align_sequence(const NucleotideSequence& seq) co
             .is_secondary = (details.flag & BAM_FSECONDARY) != 0,
             .is_reverse = details.is_rev != 0,
             // TODO: Revert the CIGAR string and/or subsequences when the match is reversed?
-            .cigar = cigar_compressed_to_string(details.cigar, details.n_cigar),
+            .cigar = cigar_compressed_to_string(cigar_bwa_to_bam(details.cigar, details.n_cigar)),
             .score = details.score,
         });
         free(details.cigar);
@@ -179,3 +371,30 @@ std::vector<BwaMatch> BwaIndex::align_sequence(const NucleotideSequence& seq) co
     free(aligns.a);
     return matches;
 }
+
+std::vector<BwaRecord> BwaIndex::align_records(std::string_view query) const {
+    bwaidx_t* index = resources->index;
+    if (index == nullptr)
+        return {};
+
+    mem_alnreg_v aligns = mem_align1(options, index->bwt, index->bns, index->pac, query.length(), query.data());
+    std::vector<BwaRecord> records;
+    records.reserve(aligns.n);
+    for (mem_alnreg_t* align = aligns.a; align != aligns.a + aligns.n; ++align) {
+        mem_aln_t details = mem_reg2aln(options, index->bns, index->pac, query.length(), query.data(), align);
+        records.push_back({
+            .ref_index = details.rid,
+            .ref_pos = details.pos,
+            .mapq = static_cast<int32_t>(details.mapq),
+            .edit_distance = static_cast<int32_t>(details.NM),
+            .score = details.score,
+            .is_secondary = (details.flag & BAM_FSECONDARY) != 0,
+            .is_reverse = details.is_rev != 0,
+            .cigar_ops = cigar_bwa_to_bam(details.cigar, details.n_cigar),
+        });
+        free(details.cigar);
+    }
+
+    free(aligns.a);
+    return records;
+}
@@ -15,8 +15,8 @@ extern "C" {
 struct BwaMatch {
     int64_t ref_id;
     std::string ref_subseq;
-    int32_t ref_match_begin;
-    int32_t ref_match_end;
+    int64_t ref_match_begin;
+    int64_t ref_match_end;
     int32_t ref_match_len;
     std::string_view query_subseq;
     int32_t query_match_begin;
@@ -29,21 +29,77 @@ struct BwaMatch {
     int score;
 };
 
+// An alignment with only the fields of a SAM record, which BwaIndex::align_records gives without building the texts of
+// BwaMatch.
+struct BwaRecord {
+    int32_t ref_index;
+    int64_t ref_pos;
+    int32_t mapq;
+    int32_t edit_distance;
+    int score;
+    bool is_secondary;
+    bool is_reverse;
+    // CIGAR in the BAM encoding.
+    std::vector<uint32_t> cigar_ops;
+};
+
+// Marks alignments of a single query as primary or secondary the way libbwa does, for alignments gathered from several
+// indexes: an alignment is secondary if its query range overlaps a better primary alignment by at least mask_level of
+// the shorter of the two ranges.
+void mark_primary(std::vector<BwaMatch>& matches, float mask_level);
+
 class BwaIndex {
 public:
-    explicit BwaIndex();
+    // Buffers owned by the index are allocated in a child of the given memory context, so that they are accounted for
+    // by Postgres. What libbwa allocates with malloc is freed by a reset callback of that context, so the whole index
+    // is released if the query fails, even though an error unwinds past the destructor.
+    explicit BwaIndex(MemoryContext parent);
+    // Moving keeps the buffers in place, so the pointers of libbwa into them stay valid.
+    BwaIndex(BwaIndex&& other) noexcept;
+    BwaIndex(const BwaIndex&) = delete;
+    BwaIndex& operator=(const BwaIndex&) = delete;
+    BwaIndex& operator=(BwaIndex&&) = delete;
     ~BwaIndex();
 
     std::vector<BwaMatch> align_sequence(const NucleotideSequence& seq) const;
-    void build();
-    void add_ref_sequence(int64_t id, const NucleotideSequence& seq);
+    // Aligns a query given as text, for callers that already have it.
+    std::vector<BwaRecord> align_records(std::string_view query) const;
+    // Preallocates pac_bytes for the pacs of the references, which is only a hint: the buffer grows past it if needed.
+    void reserve(size_t pac_bytes);
+    // Shrinks the buffer to the references, and builds the BWT in memory if that fits in memory_budget bytes or the
+    // references are short, and with the disk-based BWT-SW algorithm otherwise.
+    void build(size_t memory_budget);
+    // References too long for a single value are added in chunks, each continuing the previous one: chunk_offset is
+    // the position of the chunk in its reference, and the chunks must come in order. A reference may span up to
+    // INT32_MAX nucleotides, the limit of libbwa.
+    void add_ref_sequence(int64_t id, const NucleotideSequence& seq, int64_t chunk_offset = 0);
+
+    size_t reference_count() const { return resources->annotations.size(); }
+    int64_t reference_id(size_t index) const { return reinterpret_cast<int64_t>(resources->annotations[index].name); }
+    int32_t reference_len(size_t index) const { return resources->annotations[index].len; }
 
     mem_opt_t* options;
 
 private:
-    std::vector<ubyte_t> pac_forward;
-    std::vector<bntamb1_t> holes;
-    std::vector<bntann1_t> annotations; 
-    bwaidx_t* index;
+    // Everything allocated outside of memory. It lives in memory itself, so that the callback can find it after the
+    // index object is gone.
+    struct Resources {
+        MemoryContextCallback callback;
+        mem_opt_t* options;
+        bwaidx_t* index;
+        std::vector<bntamb1_t> holes;
+        std::vector<bntann1_t> annotations;
+    };
+    static void free_resources(void* arg);
+
+    void resize_pac(size_t capacity);
+    bwt_t* build_bwt_in_memory();
+    bwt_t* build_bwt_external();
+
+    MemoryContext memory;
+    Resources* resources;
+    ubyte_t* pac_forward;
+    size_t pac_size;
+    size_t pac_capacity;
 };
 
@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <numeric>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "cluster.h"
+#include "edit_distance.h"
+#include "parallel.h"
+#include "sequence.h"
+
+inline namespace {
+
+constexpr size_t batch_size = 1024;
+constexpr size_t unassigned = SIZE_MAX;
+// Representatives kept per hash in the index. Near-identical sequences that still become separate representatives share
+// almost all of their hashes, so without a cap counting the shared hashes would be quadratic in their number. The first
+// representatives are kept, and one whose hashes are all taken is only found within its own batch. That may split a
+// cluster, but never puts a sequence in a cluster it does not match.
+constexpr size_t max_posting_len = 256;
+
+// splitmix64 finalizer, so that the smallest hashes are a uniform sample of the k-mers.
+uint64_t mix_hash(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+void keep_smallest(std::vector<uint64_t>& hashes, uint32_t sketch_size) {
+    std::sort(hashes.begin(), hashes.end());
+    hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+    hashes.resize(std::min<size_t>(hashes.size(), sketch_size));
+}
+
+// Sorted smallest distinct hashes of the k-mers that do not overlap holes. Once there are sketch_size of them, larger
+// hashes are dropped right away, so only a few k-mers of a long sequence ever get sorted.
+std::vector<uint64_t> kmer_sketch(const SequenceView& seq, uint32_t kmer_len, uint32_t sketch_size) {
+    const uint64_t mask = kmer_len == 32 ? ~uint64_t(0) : (uint64_t(1) << 2 * kmer_len) - 1;
+    std::vector<uint64_t> hashes;
+    uint64_t threshold = ~uint64_t(0);
+    uint64_t kmer = 0;
+    uint32_t valid = 0;
+    uint32_t hole = 0;
+
+    for (uint32_t i = 0; i < seq.len; i++) {
+        while (hole < seq.holes_num && seq.holes[hole].offset + seq.holes[hole].len <= i)
+            hole++;
+        if (hole < seq.holes_num && seq.holes[hole].offset <= i) {
+            valid = 0;
+            continue;
+        }
+
+        kmer = (kmer << 2 | pac_raw_get(seq.pac, i)) & mask;
+        if (++valid < kmer_len)
+            continue;
+
+        const uint64_t hash = mix_hash(kmer);
+        if (hash > threshold)
+            continue;
+
+        hashes.push_back(hash);
+        if (hashes.size() >= 4 * static_cast<size_t>(sketch_size)) {
+            keep_smallest(hashes, sketch_size);
+            if (hashes.size() == sketch_size)
+                threshold = hashes.back();
+        }
+    }
+
+    keep_smallest(hashes, sketch_size);
+    return hashes;
+}
+
+size_t shared_hashes(const std::vector<uint64_t>& a, const std::vector<uint64_t>& b) {
+    size_t count = 0;
+    for (auto i = a.begin(), j = b.begin(); i != a.end() && j != b.end();) {
+        if (*i < *j) {
+            i++;
+        } else if (*j < *i) {
+            j++;
+        } else {
+            count++;
+            i++;
+            j++;
+        }
+    }
+    return count;
+}
+
+// Keeps the max_candidates representatives sharing the most hashes, ties broken by rank, and returns them by rank, so
+// that they are tried in the order in which they became representatives, like in CD-HIT.
+std::vector<size_t> best_candidates(std::vector<std::pair<size_t, size_t>>& shared, uint32_t max_candidates,
+        const std::vector<size_t>& rank) {
+    auto better = [&](const auto& a, const auto& b) {
+        return a.first != b.first ? a.first > b.first : rank[a.second] < rank[b.second];
+    };
+    const size_t kept = std::min<size_t>(shared.size(), max_candidates);
+    std::partial_sort(shared.begin(), shared.begin() + kept, shared.end(), better);
+
+    std::vector<size_t> candidates(kept);
+    std::transform(shared.begin(), shared.begin() + kept, candidates.begin(), [](const auto& s) { return s.second; });
+    std::sort(candidates.begin(), candidates.end(), [&](size_t a, size_t b) { return rank[a] < rank[b]; });
+    return candidates;
+}
+
+// Matches the sequence against the candidates in order and returns the first match, not the closest one. The pattern
+// is built only if there is any candidate.
+std::optional<ClusterMember> match_candidates(const SequenceSet& set, size_t index,
+        const std::vector<size_t>& candidates, double identity) {
+    if (candidates.empty())
+        return std::nullopt;
+
+    const SequenceView seq = set.view(index);
+    const MyersPattern pattern(seq);
+    for (size_t candidate : candidates) {
+        const SequenceView rep = set.view(candidate);
+        const uint32_t shorter = std::min(seq.len, rep.len);
+        const uint32_t max_dist = static_cast<uint32_t>(std::floor((1 - identity) * shorter + 1e-9));
+
+        if (std::max(seq.len, rep.len) - shorter > max_dist)
+            continue;
+
+        const uint32_t dist = pattern.distance(rep, max_dist);
+        if (dist <= max_dist)
+            return ClusterMember{ candidate, shorter == 0 ? 1.0 : 1.0 - static_cast<double>(dist) / shorter };
+    }
+
+    return std::nullopt;
+}
+
+}
+
+std::optional<std::vector<ClusterMember>> greedy_cluster(const SequenceSet& set, double identity,
+        const ClusterOptions& options, const std::function<bool()>& should_stop) {
+    const size_t n = set.size();
+
+    std::vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return set.view(a).len > set.view(b).len; });
+    // Positions in the order, which is also the order in which the representatives appear.
+    std::vector<size_t> rank(n);
+    for (size_t r = 0; r < n; r++)
+        rank[order[r]] = r;
+
+    std::vector<std::vector<uint64_t>> sketches(n);
+    parallel_for(n, options.threads, [&](size_t i, unsigned) {
+        sketches[i] = kmer_sketch(set.view(i), options.kmer_len, options.sketch_size);
+    });
+
+    std::vector<ClusterMember> members(n, ClusterMember{ unassigned, 0 });
+    // Representatives by the hashes of their sketches. It only changes between the parallel phases.
+    std::unordered_map<uint64_t, std::vector<size_t>> index;
+
+    for (size_t begin = 0; begin < n; begin += batch_size) {
+        const size_t end = std::min(n, begin + batch_size);
+        if (should_stop())
+            return std::nullopt;
+
+        // Sequences are handed out one at a time, as their costs differ a lot.
+        parallel_for(end - begin, options.threads, [&](size_t task, unsigned) {
+            const size_t i = order[begin + task];
+
+            std::unordered_map<size_t, size_t> counts;
+            for (uint64_t hash : sketches[i]) {
+                if (auto reps = index.find(hash); reps != index.end()) {
+                    for (size_t rep : reps->second)
+                        counts[rep]++;
+                }
+            }
+
+            std::vector<std::pair<size_t, size_t>> shared;
+            for (auto [rep, count] : counts)
+                shared.emplace_back(count, rep);
+
+            const auto candidates = best_candidates(shared, options.max_candidates, rank);
+            if (auto member = match_candidates(set, i, candidates, identity))
+                members[i] = *member;
+        });
+
+        std::vector<size_t> batch_reps;
+        for (size_t t = begin; t < end; t++) {
+            const size_t i = order[t];
+            if (members[i].representative != unassigned)
+                continue;
+
+            std::vector<std::pair<size_t, size_t>> shared;
+            for (size_t rep : batch_reps) {
+                if (size_t count = shared_hashes(sketches[i], sketches[rep]); count > 0)
+                    shared.emplace_back(count, rep);
+            }
+
+            const auto candidates = best_candidates(shared, options.max_candidates, rank);
+            if (auto member = match_candidates(set, i, candidates, identity)) {
+                members[i] = *member;
+                continue;
+            }
+
+            members[i] = { i, 1.0 };
+            batch_reps.push_back(i);
+            for (uint64_t hash : sketches[i]) {
+                if (std::vector<size_t>& reps = index[hash]; reps.size() < max_posting_len)
+                    reps.push_back(i);
+            }
+        }
+    }
+
+    return members;
+}
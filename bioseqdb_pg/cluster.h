@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <vector>
+
+#include "sequence.h"
+
+struct ClusterOptions {
+    uint32_t kmer_len;
+    uint32_t sketch_size;
+    uint32_t max_candidates;
+    unsigned threads;
+};
+
+struct ClusterMember {
+    // Index of the representative in the set, the sequence itself for representatives.
+    size_t representative;
+    // 1 - edit distance / length of the shorter sequence.
+    double identity;
+};
+
+// Greedy incremental clustering in the style of CD-HIT: sequences are visited from the longest one, and each joins the
+// first representative it matches with at least the given identity, or becomes a representative itself. Candidate
+// representatives are the ones sharing the most k-mers in bottom-sketch_size MinHash sketches, and at most
+// max_candidates of them are verified with the banded edit distance, in the order in which they became representatives.
+// Only the first few hundred representatives with a given hash are indexed under it, which bounds the work per sequence
+// when many near-identical sequences stay apart. Sequences without a single k-mer free of ambiguous symbols never match
+// anything.
+//
+// Sequences are compared against the representatives in batches spread over the threads, and then against the
+// representatives that appeared within the batch. The batches do not depend on the number of threads, so neither does
+// the result. should_stop is polled on the calling thread before every batch, and once it returns true the clustering
+// stops and returns nullopt.
+std::optional<std::vector<ClusterMember>> greedy_cluster(const SequenceSet& set, double identity,
+        const ClusterOptions& options, const std::function<bool()>& should_stop);
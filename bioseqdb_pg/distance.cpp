@@ -0,0 +1,67 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "distance.h"
+#include "sequence.h"
+
+inline namespace {
+
+constexpr size_t bases_per_word = 32;
+// Early exit is checked between slices of this many bases.
+constexpr size_t slice_size = 4096;
+
+// Calls f(p, q) for every maximal range [p, q) not covered by a hole of either sequence, until f returns false.
+template<typename F>
+void for_each_unmasked_block(const SequenceView& a, const SequenceView& b, F f) {
+    uint32_t i = 0, j = 0;
+    uint64_t p = 0;
+
+    while (i < a.holes_num || j < b.holes_num) {
+        const bntamb1_t& hole = (j >= b.holes_num || (i < a.holes_num && a.holes[i].offset <= b.holes[j].offset))
+                ? a.holes[i++]
+                : b.holes[j++];
+
+        if (static_cast<uint64_t>(hole.offset) > p && !f(p, hole.offset))
+            return;
+        p = std::max<uint64_t>(p, hole.offset + hole.len);
+    }
+
+    if (p < a.len)
+        f(p, a.len);
+}
+
+uint32_t count_mismatches(const ubyte_t* a, const ubyte_t* b, size_t p, size_t q) {
+    uint32_t count = 0;
+
+    for (; p < q && p % bases_per_word != 0; p++)
+        count += pac_raw_get(a, p) != pac_raw_get(b, p);
+
+    // Every base is two bits, so a base differs iff either bit of its pair is set in the xor.
+    for (; p + bases_per_word <= q; p += bases_per_word) {
+        uint64_t word_a, word_b;
+        std::memcpy(&word_a, a + p / 4, sizeof(uint64_t));
+        std::memcpy(&word_b, b + p / 4, sizeof(uint64_t));
+        const uint64_t diff = word_a ^ word_b;
+        count += __builtin_popcountll((diff | diff >> 1) & 0x5555555555555555ull);
+    }
+
+    for (; p < q; p++)
+        count += pac_raw_get(a, p) != pac_raw_get(b, p);
+
+    return count;
+}
+
+}
+
+uint32_t hamming_distance(const SequenceView& a, const SequenceView& b, uint32_t max_dist) {
+    uint64_t dist = 0;
+
+    for_each_unmasked_block(a, b, [&](uint64_t p, uint64_t q) {
+        for (; p < q && dist <= max_dist; p += slice_size)
+            dist += count_mismatches(a.pac, b.pac, p, std::min(q, p + slice_size));
+        return dist <= max_dist;
+    });
+
+    return static_cast<uint32_t>(std::min<uint64_t>(dist, static_cast<uint64_t>(max_dist) + 1));
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "parallel.h"
+#include "sequence.h"
+
+// Number of positions at which two equal-length sequences differ. Positions where either sequence holds an ambiguous
+// symbol are not counted, which is the usual convention for SNP distances. Returns max_dist + 1 as soon as the
+// distance is known to exceed max_dist.
+uint32_t hamming_distance(const SequenceView& a, const SequenceView& b, uint32_t max_dist);
+
+struct DistanceRow {
+    size_t a;
+    size_t b;
+    uint32_t dist;
+};
+
+// Computes hamming distances of all pairs a < b in the set, keeping only those not exceeding max_dist. The pairs are
+// processed in square tiles, so that both sides of a tile stay in cache, and the tiles are spread over the threads.
+// emit is called on the calling thread with every finished batch of rows, so it may safely talk to Postgres. It is
+// called after every round of tiles, even without any rows, and returns true to stop the computation, e.g. when an
+// interrupt is pending. Returns false if the computation was stopped.
+template<typename F>
+bool pairwise_hamming(const SequenceSet& set, uint32_t max_dist, unsigned threads, F emit) {
+    constexpr size_t tile_size = 64;
+    const size_t tiles_num = (set.size() + tile_size - 1) / tile_size;
+
+    std::vector<std::pair<size_t, size_t>> tiles;
+    for (size_t i = 0; i < tiles_num; i++) {
+        for (size_t j = i; j < tiles_num; j++)
+            tiles.emplace_back(i, j);
+    }
+
+    // Bound the number of buffered rows by handing out a limited number of tiles per round.
+    const size_t round_size = std::max<size_t>(threads, 1) * 16;
+    std::vector<std::vector<DistanceRow>> rows(std::max<size_t>(threads, 1));
+
+    for (size_t round = 0; round < tiles.size(); round += round_size) {
+        const size_t round_end = std::min(tiles.size(), round + round_size);
+
+        parallel_for(round_end - round, threads, [&](size_t task, unsigned worker) {
+            auto [tile_a, tile_b] = tiles[round + task];
+            const size_t a_end = std::min(set.size(), (tile_a + 1) * tile_size);
+            const size_t b_end = std::min(set.size(), (tile_b + 1) * tile_size);
+
+            for (size_t a = tile_a * tile_size; a < a_end; a++) {
+                const SequenceView view_a = set.view(a);
+                for (size_t b = std::max(a + 1, tile_b * tile_size); b < b_end; b++) {
+                    uint32_t dist = hamming_distance(view_a, set.view(b), max_dist);
+                    if (dist <= max_dist)
+                        rows[worker].push_back({a, b, dist});
+                }
+            }
+        });
+
+        bool stop = false;
+        for (auto& worker_rows : rows) {
+            stop = emit(worker_rows) || stop;
+            worker_rows.clear();
+        }
+        if (stop)
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#include "edit_distance.h"
+#include "sequence.h"
+
+inline namespace {
+
+constexpr size_t block_rows = 64;
+constexpr size_t ambiguous_row = 4;
+
+// Advances one block of the vertical deltas (Pv, Mv) by a text symbol, given the horizontal delta entering the block
+// at its top row, and returns the delta leaving it at its bottom row (Hyyrö's formulation of Myers' algorithm).
+int advance_block(uint64_t& pv, uint64_t& mv, uint64_t eq, int hin, uint64_t high_bit) {
+    const uint64_t hin_neg = hin < 0 ? 1 : 0;
+    const uint64_t xv = eq | mv;
+    eq |= hin_neg;
+    const uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+    uint64_t ph = mv | ~(xh | pv);
+    uint64_t mh = pv & xh;
+
+    const int hout = (ph & high_bit ? 1 : 0) - (mh & high_bit ? 1 : 0);
+
+    ph = ph << 1 | (hin > 0 ? 1 : 0);
+    mh = mh << 1 | hin_neg;
+    pv = mh | ~(xv | ph);
+    mv = ph & xv;
+    return hout;
+}
+
+}
+
+MyersPattern::MyersPattern(const SequenceView& pattern)
+    : len(pattern.len), blocks_num(std::max<size_t>(1, (pattern.len + block_rows - 1) / block_rows)),
+      peq((ambiguous_row + 1) * blocks_num, 0) {
+    uint32_t hole = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        while (hole < pattern.holes_num && pattern.holes[hole].offset + pattern.holes[hole].len <= i)
+            hole++;
+        if (hole < pattern.holes_num && pattern.holes[hole].offset <= i)
+            continue;
+
+        peq[pac_raw_get(pattern.pac, i) * blocks_num + i / block_rows] |= uint64_t(1) << (i % block_rows);
+    }
+}
+
+uint32_t MyersPattern::distance(const SequenceView& text, uint32_t max_dist) const {
+    return run(text, max_dist, true).distance;
+}
+
+EditMatch MyersPattern::search(const SequenceView& text, uint32_t max_dist) const {
+    return run(text, max_dist, false);
+}
+
+// Cells of the computed blocks are exact wherever they are within max_dist, and upper bounds elsewhere. Blocks entering
+// the computation start from the upper bound of increasing by one in every row, and the top row of the first computed
+// block is assumed to increase by one in every column, neither of which can lower a value that exceeds max_dist.
+EditMatch MyersPattern::run(const SequenceView& text, uint32_t max_dist, bool global) const {
+    const int64_t m = len;
+    const int64_t n = text.len;
+    // No distance exceeds the length of the longer sequence.
+    const int64_t k = std::min<int64_t>(max_dist, std::max(m, n));
+    const EditMatch none { max_dist + 1, 0 };
+
+    if (global && std::abs(m - n) > k)
+        return none;
+    if (m == 0)
+        return global ? EditMatch{ static_cast<uint32_t>(n), static_cast<uint32_t>(n) } : EditMatch{ 0, 0 };
+
+    auto rows = [&](size_t b) {
+        return b + 1 < blocks_num ? static_cast<int64_t>(block_rows) : m - static_cast<int64_t>(b * block_rows);
+    };
+    auto block_end = [&](size_t b) { return static_cast<int64_t>(b * block_rows) + rows(b); };
+    auto row_mask = [&](size_t b) { return rows(b) == static_cast<int64_t>(block_rows) ? ~uint64_t(0) : (uint64_t(1) << rows(b)) - 1; };
+
+    std::vector<uint64_t> pv(blocks_num, ~uint64_t(0));
+    std::vector<uint64_t> mv(blocks_num, 0);
+    // Value of the bottom row of every block in the current column.
+    std::vector<int64_t> score(blocks_num);
+    for (size_t b = 0; b < blocks_num; b++)
+        score[b] = block_end(b);
+
+    // Every cell of a block is at least its bottom value minus the number of increasing rows.
+    auto min_bound = [&](size_t b) { return score[b] - __builtin_popcountll(pv[b] & row_mask(b)); };
+
+    size_t first = 0;
+    size_t last = (std::max<int64_t>(1, std::min(m, k)) - 1) / block_rows;
+    EditMatch best = !global && m <= k ? EditMatch{ static_cast<uint32_t>(m), 0 } : none;
+    uint32_t hole = 0;
+
+    for (int64_t j = 1; j <= n; j++) {
+        const uint64_t pos = j - 1;
+        while (hole < text.holes_num && text.holes[hole].offset + text.holes[hole].len <= static_cast<int64_t>(pos))
+            hole++;
+        const bool ambiguous = hole < text.holes_num && text.holes[hole].offset <= static_cast<int64_t>(pos);
+        const uint64_t* eq = peq.data() + (ambiguous ? ambiguous_row : pac_raw_get(text.pac, pos)) * blocks_num;
+
+        if (global) {
+            // D[i][j] >= j - i, so blocks above the diagonal band can never get back within max_dist. The last block
+            // is still computed, as the next one may have to start from its bottom row.
+            while (first < last && block_end(first) < j - k)
+                first++;
+        }
+
+        int64_t prev_bottom = score[last];
+        int hin = global ? 1 : 0;
+        for (size_t b = first; b <= last; b++) {
+            hin = advance_block(pv[b], mv[b], eq[b], hin, uint64_t(1) << (rows(b) - 1));
+            score[b] += hin;
+        }
+
+        // Ukkonen's cutoff: the next block is needed once the bottom row of the last one gets within reach.
+        while (last + 1 < blocks_num && (prev_bottom <= k || score[last] < k)) {
+            last++;
+            pv[last] = ~uint64_t(0);
+            mv[last] = 0;
+            prev_bottom += rows(last);
+            hin = advance_block(pv[last], mv[last], eq[last], hin, uint64_t(1) << (rows(last) - 1));
+            score[last] = prev_bottom + hin;
+        }
+
+        while (last > first && min_bound(last) > k)
+            last--;
+
+        if (global) {
+            bool reachable = false;
+            for (size_t b = first; b <= last && !reachable; b++)
+                reachable = min_bound(b) <= k;
+            if (!reachable)
+                return none;
+        } else if (last + 1 == blocks_num && score[last] < best.distance && score[last] <= k) {
+            best = { static_cast<uint32_t>(score[last]), static_cast<uint32_t>(j) };
+            if (best.distance == 0)
+                break;
+        }
+    }
+
+    if (global)
+        return last + 1 == blocks_num && score[last] <= k ? EditMatch{ static_cast<uint32_t>(score[last]), text.len } : none;
+    return best;
+}
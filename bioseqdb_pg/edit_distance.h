@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "sequence.h"
+
+struct EditMatch {
+    uint32_t distance;
+    // One past the last symbol of the text covered by the match.
+    uint32_t end;
+};
+
+// Pattern preprocessed for Myers' bit-parallel edit distance, with the columns of the dynamic programming matrix split
+// into 64-row blocks. Only the blocks that can still hold values within max_dist are computed (Ukkonen's cutoff, and the
+// diagonal band for global distances), and the computation stops as soon as max_dist is known to be exceeded.
+// Ambiguous symbols never match, on either side. The object is immutable once built, so it may be shared between
+// threads.
+class MyersPattern {
+public:
+    explicit MyersPattern(const SequenceView& pattern);
+
+    // Edit distance between the pattern and the text, or max_dist + 1 if it exceeds max_dist.
+    uint32_t distance(const SequenceView& text, uint32_t max_dist) const;
+
+    // Best approximate occurrence of the pattern in the text, the one ending first among those with the lowest
+    // distance. The distance is max_dist + 1 if there is none within max_dist.
+    EditMatch search(const SequenceView& text, uint32_t max_dist) const;
+
+private:
+    EditMatch run(const SequenceView& text, uint32_t max_dist, bool global) const;
+
+    uint32_t len;
+    size_t blocks_num;
+    // Match masks of every block for codes A, C, G and T, followed by an all-zero row used for ambiguous text symbols.
+    std::vector<uint64_t> peq;
+};
@@ -2,22 +2,46 @@
 #include <array>
 #include <chrono>
 #include <charconv>
+#include <map>
 #include <string>
 #include <string_view>
 #include <optional>
+#include <unordered_map>
 #include <stdint.h>
+#include <cstddef>
 #include <cstdlib>
 
 extern "C" {
 #include <postgres.h>
 #include <fmgr.h>
+#include <access/detoast.h>
 #include <funcapi.h>
 #include <miscadmin.h>
 #include <executor/spi.h>
+#include <executor/tuptable.h>
+#include <catalog/pg_authid.h>
 #include <catalog/pg_type.h>
+#include <common/file_utils.h>
+#include <libpq/pqformat.h>
+#include <nodes/primnodes.h>
+#include <nodes/supportnodes.h>
+#include <storage/fd.h>
+#include <utils/acl.h>
+#include <utils/builtins.h>
+#include <utils/lsyscache.h>
+#include <utils/memutils.h>
+#include <utils/syscache.h>
+#include <utils/tuplestore.h>
 }
 
+#include "bam.h"
 #include "bwa.h"
+#include "cluster.h"
+#include "distance.h"
+#include "edit_distance.h"
+#include "fasta.h"
+#include "parallel.h"
+#include "protein.h"
 #include "sequence.h"
 
 #define raise_pg_error(code, msg) ereport(ERROR, (errcode(code)), msg);
@@ -31,6 +55,64 @@ text *string_view_to_text(std::string_view s) {
     return result;
 }
 
+void check_nucleotides(std::string_view text, const char* source) {
+    if (text.length() > INT32_MAX / 4)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("provided sequence is too long"));
+
+    for (char chr : text) {
+        if (std::find(allowed_nucleotides.begin(), allowed_nucleotides.end(), chr) == allowed_nucleotides.end()) {
+            raise_pg_error(ERRCODE_INVALID_TEXT_REPRESENTATION,
+                    errmsg("invalid nucleotide in %s: '%c'", source, chr));
+        }
+    }
+}
+
+// Only the fixed header is detoasted, which holds the length and the composition of the sequence. For compressed or
+// external values this avoids decompressing the whole sequence.
+const NucleotideSequence* detoast_header(Datum datum) {
+    return reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM_SLICE(datum, 0,
+            offsetof(NucleotideSequence, data) - VARHDRSZ));
+}
+
+const CodonTable* get_codon_table(int32_t id) {
+    const CodonTable* table = find_codon_table(id);
+    if (table == nullptr)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("unsupported genetic code %d", id));
+    return table;
+}
+
+// The nuclseq type of the schema the called function belongs to, so that it does not matter whether the extension is
+// on the search_path, nor whether another schema on it has a type of the same name.
+Oid get_nuclseq_oid(FunctionCallInfo fcinfo) {
+    Oid namespace_oid = get_func_namespace(fcinfo->flinfo->fn_oid);
+    Oid nuclseq_oid = GetSysCacheOid2(TYPENAMENSP, Anum_pg_type_oid, CStringGetDatum("nuclseq"),
+            ObjectIdGetDatum(namespace_oid));
+    if (!OidIsValid(nuclseq_oid))
+        raise_pg_error(ERRCODE_UNDEFINED_OBJECT, errmsg("type nuclseq does not exist in the schema of the extension"));
+    return nuclseq_oid;
+}
+
+// Whether a pending interrupt cancels the query. Kernels running on worker threads poll it from their callbacks and
+// stop, rather than calling CHECK_FOR_INTERRUPTS, whose longjmp would skip the destructors of their C++ objects.
+bool cancel_pending() {
+    return INTERRUPTS_PENDING_CONDITION() && (QueryCancelPending || ProcDiePending);
+}
+
+// Serves the interrupt that stopped a kernel, once its objects are destroyed. The results are incomplete, so the query
+// is canceled even if the interrupt turns out not to raise an error.
+void cancel_stopped_query() {
+    CHECK_FOR_INTERRUPTS();
+    raise_pg_error(ERRCODE_QUERY_CANCELED, errmsg("canceling statement due to user request"));
+}
+
+// Same rules as for COPY to or from a server-side file.
+void check_server_file_access(Oid role, const char* role_name) {
+    if (!has_privs_of_role(GetUserId(), role)) {
+        raise_pg_error(ERRCODE_INSUFFICIENT_PRIVILEGE,
+                errmsg("must be superuser or have privileges of the %s role to access server files", role_name));
+    }
+}
+
 }
 
 extern "C" {
@@ -44,17 +126,7 @@ PG_MODULE_MAGIC;
 PG_FUNCTION_INFO_V1(nuclseq_in);
 Datum nuclseq_in(PG_FUNCTION_ARGS) {
     std::string_view text = PG_GETARG_CSTRING(0);
-
-    if (text.length() > INT32_MAX / 4)
-        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("provided sequence is too long"));
-
-    for (char chr : text) {
-        if (std::find(allowed_nucleotides.begin(), allowed_nucleotides.end(), chr) == allowed_nucleotides.end()) {
-            raise_pg_error(ERRCODE_INVALID_TEXT_REPRESENTATION,
-                    errmsg("invalid nucleotide in nuclseq_in: '%c'", chr));
-        }
-    }
-
+    check_nucleotides(text, "nuclseq_in");
     PG_RETURN_POINTER(nuclseq_from_text(text));
 }
 
@@ -66,23 +138,46 @@ Datum nuclseq_out(PG_FUNCTION_ARGS) {
 
 PG_FUNCTION_INFO_V1(nuclseq_len);
 Datum nuclseq_len(PG_FUNCTION_ARGS) {
-    auto nucls = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
-    PG_RETURN_UINT64(nucls->length());
+    PG_RETURN_UINT64(detoast_header(PG_GETARG_DATUM(0))->length());
 }
 
 PG_FUNCTION_INFO_V1(nuclseq_content);
 Datum nuclseq_content(PG_FUNCTION_ARGS) {
-    auto nucls = reinterpret_cast<NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
     std::string_view needle = PG_GETARG_CSTRING(1);
     if (needle.length() != 1 || std::find(allowed_nucleotides.begin(), allowed_nucleotides.end(), needle[0]) == allowed_nucleotides.end()) {
         raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE,
                 errmsg("invalid nucleotide in nuclseq_content: '%s'", needle.data()));
     }
 
+    // Counts of ACGTN are kept in the header, other ambiguous symbols have to be counted in the holes.
+    auto nucls = std::string_view("ACGTN").find(needle[0]) != std::string_view::npos
+            ? detoast_header(PG_GETARG_DATUM(0))
+            : reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
     auto matches = static_cast<double>(nucls->occurences(needle[0]));
     PG_RETURN_FLOAT8(matches / nucls->length());
 }
 
+// GC content over the unambiguous nucleotides, NULL if there are none.
+PG_FUNCTION_INFO_V1(nuclseq_gc);
+Datum nuclseq_gc(PG_FUNCTION_ARGS) {
+    auto nucls = detoast_header(PG_GETARG_DATUM(0));
+    const uint32_t* counts = nucls->composition;
+    const uint64_t total = uint64_t(counts[0]) + counts[1] + counts[2] + counts[3];
+    if (total == 0)
+        PG_RETURN_NULL();
+
+    PG_RETURN_FLOAT8(static_cast<double>(uint64_t(counts[1]) + counts[2]) / total);
+}
+
+PG_FUNCTION_INFO_V1(nuclseq_n_fraction);
+Datum nuclseq_n_fraction(PG_FUNCTION_ARGS) {
+    auto nucls = detoast_header(PG_GETARG_DATUM(0));
+    if (nucls->length() == 0)
+        PG_RETURN_NULL();
+
+    PG_RETURN_FLOAT8(static_cast<double>(nucls->composition[composition_n]) / nucls->length());
+}
+
 PG_FUNCTION_INFO_V1(nuclseq_complement);
 Datum nuclseq_complement(PG_FUNCTION_ARGS) {
     auto nucls = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
@@ -95,12 +190,143 @@ Datum nuclseq_reverse(PG_FUNCTION_ARGS) {
     PG_RETURN_POINTER(nucls->reverse());
 }
 
+PG_FUNCTION_INFO_V1(nuclseq_hamming);
+Datum nuclseq_hamming(PG_FUNCTION_ARGS) {
+    auto nucls_a = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
+    auto nucls_b = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(1)));
+    int32_t max_dist = PG_GETARG_INT32(2);
+
+    if (max_dist < 0)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("max_dist must be nonnegative"));
+    if (nucls_a->length() != nucls_b->length())
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("nuclseq_hamming requires sequences of equal length"));
+
+    PG_RETURN_INT32(hamming_distance(nucls_a->view(), nucls_b->view(), max_dist));
+}
+
+PG_FUNCTION_INFO_V1(protseq_in);
+Datum protseq_in(PG_FUNCTION_ARGS) {
+    std::string_view text = PG_GETARG_CSTRING(0);
+    for (char chr : text) {
+        if (amino_code_from_char(chr) < 0)
+            raise_pg_error(ERRCODE_INVALID_TEXT_REPRESENTATION, errmsg("invalid amino acid in protseq_in: '%c'", chr));
+    }
+
+    PG_RETURN_POINTER(protseq_from_text(text));
+}
+
+PG_FUNCTION_INFO_V1(protseq_out);
+Datum protseq_out(PG_FUNCTION_ARGS) {
+    auto prot = reinterpret_cast<const ProteinSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
+    PG_RETURN_CSTRING(prot->to_text_palloc());
+}
+
+// The binary format is the length followed by the packed codes, as they are stored.
+PG_FUNCTION_INFO_V1(protseq_recv);
+Datum protseq_recv(PG_FUNCTION_ARGS) {
+    StringInfo buf = reinterpret_cast<StringInfo>(PG_GETARG_POINTER(0));
+    uint32_t len = pq_getmsgint(buf, 4);
+    if (protein_byte_size(len) > MaxAllocSize - offsetof(ProteinSequence, data))
+        raise_pg_error(ERRCODE_INVALID_BINARY_REPRESENTATION, errmsg("invalid protseq length %u", len));
+
+    ProteinSequence* prot = protseq_alloc(len);
+    std::copy_n(pq_getmsgbytes(buf, protein_byte_size(len)), protein_byte_size(len), prot->data);
+
+    // Codes must be valid, and the padding must be zero for equal values to have equal bits.
+    for (uint32_t i = 0; i < len; i++) {
+        if (prot->code(i) >= allowed_amino_acids.size())
+            raise_pg_error(ERRCODE_INVALID_BINARY_REPRESENTATION, errmsg("invalid amino acid code in protseq_recv"));
+    }
+    const size_t last_byte_bits = size_t(len) * 5 % 8;
+    if (last_byte_bits != 0 && prot->data[protein_byte_size(len) - 1] >> last_byte_bits != 0)
+        raise_pg_error(ERRCODE_INVALID_BINARY_REPRESENTATION, errmsg("invalid padding in protseq_recv"));
+
+    PG_RETURN_POINTER(prot);
+}
+
+PG_FUNCTION_INFO_V1(protseq_send);
+Datum protseq_send(PG_FUNCTION_ARGS) {
+    auto prot = reinterpret_cast<const ProteinSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
+    StringInfoData buf;
+
+    pq_begintypsend(&buf);
+    pq_sendint32(&buf, prot->len);
+    pq_sendbytes(&buf, reinterpret_cast<const char*>(prot->data), protein_byte_size(prot->len));
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+PG_FUNCTION_INFO_V1(protseq_len);
+Datum protseq_len(PG_FUNCTION_ARGS) {
+    auto prot = reinterpret_cast<const ProteinSequence*>(PG_DETOAST_DATUM_SLICE(PG_GETARG_DATUM(0), 0,
+            offsetof(ProteinSequence, data) - VARHDRSZ));
+    PG_RETURN_INT32(prot->length());
+}
+
+PG_FUNCTION_INFO_V1(nuclseq_translate);
+Datum nuclseq_translate(PG_FUNCTION_ARGS) {
+    auto nucls = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
+    int32_t frame = PG_GETARG_INT32(1);
+    const CodonTable* table = get_codon_table(PG_GETARG_INT32(2));
+
+    if (frame == 0 || frame < -3 || frame > 3)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("frame must be one of 1, 2, 3, -1, -2, -3"));
+
+    PG_RETURN_POINTER(translate(*nucls, frame, *table));
+}
+
+PG_FUNCTION_INFO_V1(nuclseq_edit_distance);
+Datum nuclseq_edit_distance(PG_FUNCTION_ARGS) {
+    auto nucls_a = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
+    auto nucls_b = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(1)));
+    int32_t max_dist = PG_GETARG_INT32(2);
+
+    if (max_dist < 0)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("max_dist must be nonnegative"));
+
+    // The cost grows with the number of 64-symbol blocks of the pattern, so the shorter sequence is preprocessed.
+    if (nucls_a->length() > nucls_b->length())
+        std::swap(nucls_a, nucls_b);
+    PG_RETURN_INT32(MyersPattern(nucls_a->view()).distance(nucls_b->view(), max_dist));
+}
+
+// Returns NULL if the pattern does not occur in the sequence within max_dist edits.
+PG_FUNCTION_INFO_V1(nuclseq_edit_search);
+Datum nuclseq_edit_search(PG_FUNCTION_ARGS) {
+    auto pattern = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
+    auto nucls = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(1)));
+    int32_t max_dist = PG_GETARG_INT32(2);
+
+    if (max_dist < 0)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("max_dist must be nonnegative"));
+
+    EditMatch match = MyersPattern(pattern->view()).search(nucls->view(), max_dist);
+    if (match.distance > static_cast<uint32_t>(max_dist))
+        PG_RETURN_NULL();
+
+    TupleDesc tupdesc;
+    if (get_call_result_type(fcinfo, nullptr, &tupdesc) != TYPEFUNC_COMPOSITE)
+        raise_pg_error(ERRCODE_FEATURE_NOT_SUPPORTED, errmsg("return type must be a row type"));
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    std::array<bool, 2> nulls;
+    std::array<Datum, 2> values { {
+        Int32GetDatum(match.distance),
+        Int32GetDatum(match.end),
+    } };
+    nulls.fill(false);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values.data(), nulls.data())));
+}
+
 }
 
 namespace {
 
+// Calls f(id, chunk_offset, datum) for every row of the query, with the sequence as it is stored, possibly toasted.
+// Sequences split into chunks are given with a third column named chunk_offset, holding the position of the chunk in
+// its sequence; without it the offset is always 0.
 template<typename F>
-Portal iterate_nuclseq_table(const char* sql, Oid nuclseq_oid, F f) {
+Portal iterate_nuclseq_datums(const char* sql, Oid nuclseq_oid, F f) {
     Portal portal = SPI_cursor_open_with_args(nullptr, sql, 0, nullptr, nullptr, nullptr, true, 0);
     long batch_size = 1;
 
@@ -122,15 +348,20 @@ Portal iterate_nuclseq_table(const char* sql, Oid nuclseq_oid, F f) {
         if (SPI_gettypeid(tupdesc, 2) != nuclseq_oid)
             raise_pg_error(ERRCODE_DATATYPE_MISMATCH, errmsg("expected column of nuclseqs"));
 
+        const bool chunked = tupdesc->natts >= 3 && std::string_view(SPI_fname(tupdesc, 3)) == "chunk_offset";
+        if (chunked && SPI_gettypeid(tupdesc, 3) != INT8OID)
+            raise_pg_error(ERRCODE_DATATYPE_MISMATCH, errmsg("expected chunk_offset column of bigints"));
+
         for(int i = 0 ; i < n; i++) {
             HeapTuple tup = tuptable->vals[i];
-            bool null_id = false, null_seq = false;
+            bool null_id = false, null_seq = false, null_offset = false;
 
             Datum id = SPI_getbinval(tup, tupdesc, 1, &null_id);
             Datum nucls = SPI_getbinval(tup, tupdesc, 2, &null_seq);
+            int64_t chunk_offset = chunked ? DatumGetInt64(SPI_getbinval(tup, tupdesc, 3, &null_offset)) : 0;
 
-            if (!null_id && !null_seq)
-                f(static_cast<int64_t>(id), reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(nucls)));
+            if (!null_id && !null_seq && !null_offset)
+                f(static_cast<int64_t>(id), chunk_offset, nucls);
         }
 
         SPI_freetuptable(tuptable);
@@ -140,6 +371,26 @@ Portal iterate_nuclseq_table(const char* sql, Oid nuclseq_oid, F f) {
 
 }
 
+// Calls f(id, chunk_offset, nucls) for every row of the query, as iterate_nuclseq_datums. Detoasted sequences are freed
+// as soon as f returns, otherwise they would all stay in the SPI memory until SPI_finish, so f has to copy whatever it
+// keeps.
+template<typename F>
+Portal iterate_nuclseq_chunks(const char* sql, Oid nuclseq_oid, F f) {
+    return iterate_nuclseq_datums(sql, nuclseq_oid, [&](int64_t id, int64_t chunk_offset, Datum nucls) {
+        auto detoasted = reinterpret_cast<NucleotideSequence*>(PG_DETOAST_DATUM(nucls));
+        f(id, chunk_offset, detoasted);
+        if (reinterpret_cast<Pointer>(detoasted) != DatumGetPointer(nucls))
+            pfree(detoasted);
+    });
+}
+
+template<typename F>
+Portal iterate_nuclseq_table(const char* sql, Oid nuclseq_oid, F f) {
+    return iterate_nuclseq_chunks(sql, nuclseq_oid, [&](int64_t id, int64_t, const NucleotideSequence* nucls) {
+        f(id, nucls);
+    });
+}
+
 int32_t get_opt_or(HeapTupleHeader opts, const char *name, int32_t defval) {
     bool null = false;
     Datum val = GetAttributeByName(opts, name, &null);
@@ -149,21 +400,39 @@ int32_t get_opt_or(HeapTupleHeader opts, const char *name, int32_t defval) {
     int32_t num = DatumGetInt32(val);
 
     if(num < 0)
-        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("bwa_opt %s must be nonnegative", name));
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("option %s must be nonnegative", name));
 
     return num;
 }
 
-BwaIndex bwa_index_from_query(const char* sql, HeapTupleHeader opts, Oid nuclseq_oid) {
-    BwaIndex bwa;
+// Shard of a reference, by a hash of its id.
+size_t reference_shard(int64_t id, size_t shards_num) {
+    if (shards_num == 1)
+        return 0;
+    int32_t hash = DatumGetInt32(DirectFunctionCall1(hashint8, Int64GetDatum(id)));
+    return ((hash % static_cast<int64_t>(shards_num)) + shards_num) % shards_num;
+}
+
+// Adds the references of one shard to the index, the shards being assigned by a hash of the reference ids. Returns the
+// number of references of all shards.
+size_t load_shard(const char* sql, Oid nuclseq_oid, size_t shard, size_t shards_num, BwaIndex& bwa) {
     size_t count = 0;
 
-    Portal portal = iterate_nuclseq_table(sql, nuclseq_oid, [&](auto id, auto nucls){
-        bwa.add_ref_sequence(id, *nucls);
-        count++;
+    Portal portal = iterate_nuclseq_chunks(sql, nuclseq_oid, [&](auto id, auto chunk_offset, auto nucls){
+        if (reference_shard(id, shards_num) == shard)
+            bwa.add_ref_sequence(id, *nucls, chunk_offset);
+        if (chunk_offset == 0)
+            count++;
     });
     SPI_cursor_close(portal);
-    bwa.options->max_occ = get_opt_or(opts, "max_occ", std::max<int>(500, count * 2));
+
+    return count;
+}
+
+// All shards get the same options, and the default max_occ is derived from the total number of references, so that
+// seeding and scores agree between shards.
+void set_bwa_options(BwaIndex& bwa, HeapTupleHeader opts, size_t references) {
+    bwa.options->max_occ = get_opt_or(opts, "max_occ", std::max<int>(500, references * 2));
     bwa.options->min_seed_len = get_opt_or(opts, "min_seed_len", 19);
     bwa.options->a = get_opt_or(opts, "match_score", 1);
     bwa.options->b = get_opt_or(opts, "mismatch_penalty", 4);
@@ -175,8 +444,36 @@ BwaIndex bwa_index_from_query(const char* sql, HeapTupleHeader opts, Oid nuclseq
     bwa.options->o_ins = get_opt_or(opts, "o_ins", 6);
     bwa.options->e_del = get_opt_or(opts, "e_del", 1);
     bwa.options->e_ins = get_opt_or(opts, "e_ins", 1);
+}
 
-    bwa.build();
+// Bytes of the pacs of the references of every shard, so that their buffers are allocated once instead of growing by
+// doubling, which copies them over and over and takes up to twice the memory. The caller may give the total length
+// as reference_len_hint. Otherwise the query is run once more, reading only the sizes of the values from their headers,
+// so that toasted sequences are not fetched. The sizes include the holes, and the buffers are shrunk to fit before the
+// build; if a volatile query gives other references the second time, the buffers still grow as needed.
+std::vector<size_t> shard_pac_bytes(const char* sql, HeapTupleHeader opts, Oid nuclseq_oid, size_t shards_num) {
+    if (int32_t hint = get_opt_or(opts, "reference_len_hint", 0); hint > 0)
+        return std::vector<size_t>(shards_num, static_cast<size_t>(hint) * 1000000 / 4 / shards_num);
+
+    std::vector<size_t> bytes(shards_num);
+    Portal portal = iterate_nuclseq_datums(sql, nuclseq_oid, [&](auto id, auto, auto nucls){
+        bytes[reference_shard(id, shards_num)] += toast_raw_datum_size(nucls) - offsetof(NucleotideSequence, data);
+    });
+    SPI_cursor_close(portal);
+
+    return bytes;
+}
+
+size_t index_memory_budget() {
+    return static_cast<size_t>(maintenance_work_mem) * 1024;
+}
+
+BwaIndex bwa_index_from_query(const char* sql, HeapTupleHeader opts, Oid nuclseq_oid, MemoryContext memory) {
+    BwaIndex bwa(memory);
+
+    bwa.reserve(shard_pac_bytes(sql, opts, nuclseq_oid, 1)[0]);
+    set_bwa_options(bwa, opts, load_shard(sql, nuclseq_oid, 0, 1, bwa));
+    bwa.build(index_memory_budget());
 
     return bwa;
 }
@@ -229,8 +526,8 @@ HeapTuple build_tuple_bwa(std::optional<int64_t> query_id, const BwaMatch& match
     std::array<Datum, 15> values { {
         Int64GetDatum(match.ref_id),
         PointerGetDatum(nuclseq_from_text(match.ref_subseq)),
-        Int32GetDatum(match.ref_match_begin),
-        Int32GetDatum(match.ref_match_end),
+        Int64GetDatum(match.ref_match_begin),
+        Int64GetDatum(match.ref_match_end),
         Int32GetDatum(match.ref_match_len),
         Int64GetDatum(query_id.value_or(0)),
         PointerGetDatum(nuclseq_from_text(match.query_subseq)),
@@ -250,6 +547,50 @@ HeapTuple build_tuple_bwa(std::optional<int64_t> query_id, const BwaMatch& match
     return heap_form_tuple(tupledesc, values.data(), nulls.data());
 }
 
+// The fields of a bwa_result row needed to choose the primary alignments of its query among several shards, so that the
+// rows themselves can wait in a tuplestore.
+struct ShardMatch {
+    size_t query;
+    int32_t query_match_begin;
+    int32_t query_match_end;
+    int32_t score;
+};
+
+// Copies the rows of shard_rows, which come in the order of the matches, to the result, with the primary and secondary
+// flags assigned among all the matches of every query.
+void put_merged_rows(Tuplestorestate* shard_rows, const std::vector<ShardMatch>& matches, size_t queries_num,
+        float mask_level, Tuplestorestate* ret_tupstore, TupleDesc ret_tupdesc) {
+    std::vector<std::vector<size_t>> query_matches(queries_num);
+    for (size_t i = 0; i < matches.size(); i++)
+        query_matches[matches[i].query].push_back(i);
+
+    std::vector<bool> is_primary(matches.size());
+    std::vector<BwaMatch> group;
+    for (const std::vector<size_t>& indices : query_matches) {
+        group.resize(indices.size());
+        for (size_t i = 0; i < indices.size(); i++) {
+            const ShardMatch& match = matches[indices[i]];
+            group[i].query_match_begin = match.query_match_begin;
+            group[i].query_match_end = match.query_match_end;
+            group[i].score = match.score;
+        }
+
+        mark_primary(group, mask_level);
+        for (size_t i = 0; i < indices.size(); i++)
+            is_primary[indices[i]] = group[i].is_primary;
+    }
+
+    TupleTableSlot* slot = MakeSingleTupleTableSlot(ret_tupdesc, &TTSOpsMinimalTuple);
+    for (size_t i = 0; tuplestore_gettupleslot(shard_rows, true, false, slot); i++) {
+        slot_getallattrs(slot);
+        slot->tts_values[10] = BoolGetDatum(is_primary[i]);
+        slot->tts_values[11] = BoolGetDatum(!is_primary[i]);
+        slot->tts_isnull[10] = slot->tts_isnull[11] = false;
+        tuplestore_putvalues(ret_tupstore, ret_tupdesc, slot->tts_values, slot->tts_isnull);
+    }
+    ExecDropSingleTupleTableSlot(slot);
+}
+
 }
 
 extern "C" {
@@ -269,7 +610,7 @@ Datum nuclseq_search_bwa(PG_FUNCTION_ARGS) {
     TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
 
     Oid nuclseq_oid = TupleDescAttr(ret_tupdesc, 1)->atttypid;
-    BwaIndex bwa = bwa_index_from_query(reference_sql, opts, nuclseq_oid);
+    BwaIndex bwa = bwa_index_from_query(reference_sql, opts, nuclseq_oid, rsi->econtext->ecxt_per_query_memory);
     SPI_finish();
 
     Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
@@ -303,7 +644,7 @@ Datum nuclseq_multi_search_bwa(PG_FUNCTION_ARGS) {
 
     TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
     Oid nuclseq_oid = TupleDescAttr(ret_tupdesc, 1)->atttypid;
-    BwaIndex bwa = bwa_index_from_query(reference_sql, opts, nuclseq_oid);
+    BwaIndex bwa = bwa_index_from_query(reference_sql, opts, nuclseq_oid, rsi->econtext->ecxt_per_query_memory);
     Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
     AttInMetadata* attr_input_meta = TupleDescGetAttInMetadata(ret_tupdesc);
 
@@ -325,4 +666,647 @@ Datum nuclseq_multi_search_bwa(PG_FUNCTION_ARGS) {
     return (Datum) nullptr;
 }
 
+PG_FUNCTION_INFO_V1(nuclseq_distance_matrix);
+Datum nuclseq_distance_matrix(PG_FUNCTION_ARGS) {
+    ReturnSetInfo* rsi = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+    assert_can_return_set(rsi);
+
+    const char* sql = PG_GETARG_CSTRING(0);
+    int32_t max_dist = PG_GETARG_INT32(1);
+    unsigned threads = resolve_threads(PG_GETARG_INT32(2));
+
+    if (max_dist < 0)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("max_dist must be nonnegative"));
+
+    if (int ret = SPI_connect(); ret < 0)
+        elog(ERROR, "connectby: SPI_connect returned %d", ret);
+
+    TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
+
+    Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+
+    // The sequences live in a scope of their own, so that they are freed before a cancel is served.
+    bool completed;
+    {
+        // Sequences are loaded once and copied out of the SPI memory, so that the worker threads can share them.
+        SequenceSet sequences;
+        Portal portal = iterate_nuclseq_table(sql, get_nuclseq_oid(fcinfo), [&](auto id, auto nucls){
+            if (sequences.size() > 0 && nucls->length() != sequences.view(0).len)
+                raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE,
+                        errmsg("nuclseq_distance_matrix requires sequences of equal length"));
+            sequences.add(id, *nucls);
+        });
+        SPI_cursor_close(portal);
+        SPI_finish();
+
+        completed = pairwise_hamming(sequences, max_dist, threads, [&](const std::vector<DistanceRow>& rows) {
+            for (const DistanceRow& row : rows) {
+                std::array<bool, 3> nulls;
+                std::array<Datum, 3> values { {
+                    Int64GetDatum(sequences.id(row.a)),
+                    Int64GetDatum(sequences.id(row.b)),
+                    Int32GetDatum(row.dist),
+                } };
+                nulls.fill(false);
+
+                HeapTuple tuple = heap_form_tuple(ret_tupdesc, values.data(), nulls.data());
+                tuplestore_puttuple(ret_tupstore, tuple);
+                heap_freetuple(tuple);
+            }
+            return cancel_pending();
+        });
+    }
+    if (!completed)
+        cancel_stopped_query();
+
+    rsi->returnMode = SFRM_Materialize;
+    rsi->setResult = ret_tupstore;
+    rsi->setDesc = ret_tupdesc;
+    return (Datum) nullptr;
+}
+
+// Translations in all six frames, forward ones first.
+PG_FUNCTION_INFO_V1(nuclseq_translate_frames);
+Datum nuclseq_translate_frames(PG_FUNCTION_ARGS) {
+    ReturnSetInfo* rsi = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+    assert_can_return_set(rsi);
+
+    auto nucls = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
+    const CodonTable* table = get_codon_table(PG_GETARG_INT32(1));
+
+    TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
+    Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+
+    for (int32_t frame : {1, 2, 3, -1, -2, -3}) {
+        std::array<bool, 2> nulls;
+        std::array<Datum, 2> values { {
+            Int32GetDatum(frame),
+            PointerGetDatum(translate(*nucls, frame, *table)),
+        } };
+        nulls.fill(false);
+
+        HeapTuple tuple = heap_form_tuple(ret_tupdesc, values.data(), nulls.data());
+        tuplestore_puttuple(ret_tupstore, tuple);
+        heap_freetuple(tuple);
+    }
+
+    rsi->returnMode = SFRM_Materialize;
+    rsi->setResult = ret_tupstore;
+    rsi->setDesc = ret_tupdesc;
+    return (Datum) nullptr;
+}
+
+// Searches every sequence of the table for the pattern. The rows are copied out of SPI in batches, each searched by
+// the worker threads, so the table is never loaded as a whole.
+PG_FUNCTION_INFO_V1(nuclseq_edit_search_table);
+Datum nuclseq_edit_search_table(PG_FUNCTION_ARGS) {
+    constexpr size_t batch_size = 1024;
+
+    ReturnSetInfo* rsi = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+    assert_can_return_set(rsi);
+
+    auto pattern = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
+    const char* sql = PG_GETARG_CSTRING(1);
+    int32_t max_dist = PG_GETARG_INT32(2);
+    unsigned threads = resolve_threads(PG_GETARG_INT32(3));
+
+    if (max_dist < 0)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("max_dist must be nonnegative"));
+
+    if (int ret = SPI_connect(); ret < 0)
+        elog(ERROR, "connectby: SPI_connect returned %d", ret);
+
+    TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
+    Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+
+    const MyersPattern myers(pattern->view());
+    SequenceSet batch;
+    std::vector<EditMatch> matches;
+
+    auto search_batch = [&]{
+        matches.resize(batch.size());
+        parallel_for(batch.size(), threads, [&](size_t i, unsigned) {
+            matches[i] = myers.search(batch.view(i), max_dist);
+        });
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (matches[i].distance > static_cast<uint32_t>(max_dist))
+                continue;
+
+            std::array<bool, 3> nulls;
+            std::array<Datum, 3> values { {
+                Int64GetDatum(batch.id(i)),
+                Int32GetDatum(matches[i].distance),
+                Int32GetDatum(matches[i].end),
+            } };
+            nulls.fill(false);
+
+            HeapTuple tuple = heap_form_tuple(ret_tupdesc, values.data(), nulls.data());
+            tuplestore_puttuple(ret_tupstore, tuple);
+            heap_freetuple(tuple);
+        }
+        batch.clear();
+    };
+
+    Portal portal = iterate_nuclseq_table(sql, get_nuclseq_oid(fcinfo), [&](auto id, auto nucls){
+        batch.add(id, *nucls);
+        if (batch.size() >= batch_size)
+            search_batch();
+    });
+    search_batch();
+    SPI_cursor_close(portal);
+    SPI_finish();
+
+    rsi->returnMode = SFRM_Materialize;
+    rsi->setResult = ret_tupstore;
+    rsi->setDesc = ret_tupdesc;
+    return (Datum) nullptr;
+}
+
+// Clusters the sequences of the table greedily by identity. Every sequence is returned with the id of the
+// representative of its cluster, representatives being returned with their own ids.
+PG_FUNCTION_INFO_V1(nuclseq_cluster);
+Datum nuclseq_cluster(PG_FUNCTION_ARGS) {
+    ReturnSetInfo* rsi = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+    assert_can_return_set(rsi);
+
+    const char* sql = PG_GETARG_CSTRING(0);
+    double identity = PG_GETARG_FLOAT8(1);
+    HeapTupleHeader opts = PG_GETARG_HEAPTUPLEHEADER(2);
+
+    if (!(identity > 0 && identity <= 1))
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("identity must be in range (0, 1]"));
+
+    ClusterOptions options;
+    options.kmer_len = get_opt_or(opts, "kmer_len", 16);
+    options.sketch_size = get_opt_or(opts, "sketch_size", 128);
+    options.max_candidates = get_opt_or(opts, "max_candidates", 16);
+    options.threads = resolve_threads(get_opt_or(opts, "threads", 0));
+
+    if (options.kmer_len < 1 || options.kmer_len > 32)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("kmer_len must be in range [1, 32]"));
+    if (options.sketch_size < 1 || options.max_candidates < 1)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("sketch_size and max_candidates must be positive"));
+
+    if (int ret = SPI_connect(); ret < 0)
+        elog(ERROR, "connectby: SPI_connect returned %d", ret);
+
+    TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
+
+    Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+
+    // The sequences and the clusters live in a scope of their own, so that they are freed before a cancel is served.
+    bool completed;
+    {
+        SequenceSet sequences;
+        Portal portal = iterate_nuclseq_table(sql, get_nuclseq_oid(fcinfo), [&](auto id, auto nucls){
+            sequences.add(id, *nucls);
+        });
+        SPI_cursor_close(portal);
+        SPI_finish();
+
+        const auto members = greedy_cluster(sequences, identity, options, [] { return cancel_pending(); });
+        completed = members.has_value();
+        for (size_t i = 0; completed && i < members->size(); i++) {
+            std::array<bool, 4> nulls;
+            std::array<Datum, 4> values { {
+                Int64GetDatum(sequences.id(i)),
+                Int64GetDatum(sequences.id((*members)[i].representative)),
+                BoolGetDatum((*members)[i].representative == i),
+                Float8GetDatum((*members)[i].identity),
+            } };
+            nulls.fill(false);
+
+            HeapTuple tuple = heap_form_tuple(ret_tupdesc, values.data(), nulls.data());
+            tuplestore_puttuple(ret_tupstore, tuple);
+            heap_freetuple(tuple);
+        }
+    }
+    if (!completed)
+        cancel_stopped_query();
+
+    rsi->returnMode = SFRM_Materialize;
+    rsi->setResult = ret_tupstore;
+    rsi->setDesc = ret_tupdesc;
+    return (Datum) nullptr;
+}
+
+// Streams records of a server-side FASTA or FASTQ file, so that reads can be aligned without loading them into a table
+// first. The whole file is parsed on the first call, and the rows spill to disk past work_mem.
+PG_FUNCTION_INFO_V1(nuclseq_read_fasta);
+Datum nuclseq_read_fasta(PG_FUNCTION_ARGS) {
+    ReturnSetInfo* rsi = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+    assert_can_return_set(rsi);
+
+    const char* path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    unsigned threads = resolve_threads(PG_GETARG_INT32(1));
+
+    check_server_file_access(ROLE_PG_READ_SERVER_FILES, "pg_read_server_files");
+
+    TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
+    Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+
+    FastaReader reader(path, threads);
+    if (!reader.is_open())
+        ereport(ERROR, (errcode_for_file_access(), errmsg("could not open file \"%s\": %m", path)));
+
+    // The function is called once, in a context that is not reset until it returns, so every record is built in a
+    // context of its own. Otherwise the records would be kept in memory as a whole, next to the spilled tuplestore.
+    MemoryContext record_ctx = AllocSetContextCreate(CurrentMemoryContext, "fasta record", ALLOCSET_DEFAULT_SIZES);
+
+    // The reader owns a file descriptor and decompression threads, which must not outlive an error.
+    PG_TRY();
+    {
+        FastaRecord record;
+        int64_t id = 0;
+
+        while (reader.next(record)) {
+            CHECK_FOR_INTERRUPTS();
+            MemoryContext old_ctx = MemoryContextSwitchTo(record_ctx);
+            check_nucleotides(record.sequence, psprintf("record '%s'", record.name.c_str()));
+
+            std::array<bool, 4> nulls;
+            std::array<Datum, 4> values { {
+                Int64GetDatum(++id),
+                PointerGetDatum(string_view_to_text(record.name)),
+                PointerGetDatum(nuclseq_from_text(record.sequence)),
+                record.has_quality ? PointerGetDatum(string_view_to_text(record.quality)) : (Datum) 0,
+            } };
+            nulls.fill(false);
+            nulls[3] = !record.has_quality;
+
+            tuplestore_putvalues(ret_tupstore, ret_tupdesc, values.data(), nulls.data());
+            MemoryContextSwitchTo(old_ctx);
+            MemoryContextReset(record_ctx);
+        }
+
+        if (!reader.error().empty()) {
+            raise_pg_error(ERRCODE_BAD_COPY_FILE_FORMAT,
+                    errmsg("could not parse file \"%s\": %s", path, reader.error().c_str()));
+        }
+    }
+    PG_CATCH();
+    {
+        reader.close();
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    reader.close();
+    MemoryContextDelete(record_ctx);
+
+    rsi->returnMode = SFRM_Materialize;
+    rsi->setResult = ret_tupstore;
+    rsi->setDesc = ret_tupdesc;
+    return (Datum) nullptr;
+}
+
+// Reads a server-side FASTA file in chunks of at most chunk_len nucleotides, for sequences too long to be stored as a
+// single value. The rows can be used directly as references of the bwa searches.
+PG_FUNCTION_INFO_V1(nuclseq_read_fasta_chunked);
+Datum nuclseq_read_fasta_chunked(PG_FUNCTION_ARGS) {
+    ReturnSetInfo* rsi = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+    assert_can_return_set(rsi);
+
+    const char* path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    int32_t chunk_len = PG_GETARG_INT32(1);
+    unsigned threads = resolve_threads(PG_GETARG_INT32(2));
+
+    if (chunk_len <= 0 || chunk_len > INT32_MAX / 4)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("chunk_len must be between 1 and %d", INT32_MAX / 4));
+
+    check_server_file_access(ROLE_PG_READ_SERVER_FILES, "pg_read_server_files");
+
+    TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
+    Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+
+    FastaReader reader(path, threads);
+    if (!reader.is_open())
+        ereport(ERROR, (errcode_for_file_access(), errmsg("could not open file \"%s\": %m", path)));
+
+    // As in nuclseq_read_fasta, each chunk is built in a context reset after it is stored.
+    MemoryContext chunk_ctx = AllocSetContextCreate(CurrentMemoryContext, "fasta chunk", ALLOCSET_DEFAULT_SIZES);
+
+    PG_TRY();
+    {
+        FastaChunk chunk;
+        int64_t id = 0;
+
+        while (reader.next_chunk(chunk, chunk_len)) {
+            CHECK_FOR_INTERRUPTS();
+            MemoryContext old_ctx = MemoryContextSwitchTo(chunk_ctx);
+            check_nucleotides(chunk.sequence, psprintf("record '%s'", chunk.name.c_str()));
+            if (chunk.offset == 0)
+                id++;
+
+            std::array<bool, 4> nulls;
+            std::array<Datum, 4> values { {
+                Int64GetDatum(id),
+                PointerGetDatum(string_view_to_text(chunk.name)),
+                Int64GetDatum(static_cast<int64_t>(chunk.offset)),
+                PointerGetDatum(nuclseq_from_text(chunk.sequence)),
+            } };
+            nulls.fill(false);
+
+            tuplestore_putvalues(ret_tupstore, ret_tupdesc, values.data(), nulls.data());
+            MemoryContextSwitchTo(old_ctx);
+            MemoryContextReset(chunk_ctx);
+        }
+
+        if (!reader.error().empty()) {
+            raise_pg_error(ERRCODE_BAD_COPY_FILE_FORMAT,
+                    errmsg("could not parse file \"%s\": %s", path, reader.error().c_str()));
+        }
+    }
+    PG_CATCH();
+    {
+        reader.close();
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    reader.close();
+    MemoryContextDelete(chunk_ctx);
+
+    rsi->returnMode = SFRM_Materialize;
+    rsi->setResult = ret_tupstore;
+    rsi->setDesc = ret_tupdesc;
+    return (Datum) nullptr;
+}
+
+// Splits a sequence into chunks of chunk_len nucleotides, the last one possibly shorter.
+PG_FUNCTION_INFO_V1(nuclseq_split);
+Datum nuclseq_split(PG_FUNCTION_ARGS) {
+    ReturnSetInfo* rsi = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+    assert_can_return_set(rsi);
+
+    auto nucls = reinterpret_cast<const NucleotideSequence*>(PG_DETOAST_DATUM(PG_GETARG_POINTER(0)));
+    int32_t chunk_len = PG_GETARG_INT32(1);
+
+    if (chunk_len <= 0)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("chunk_len must be positive"));
+
+    TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
+    Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+
+    // Chunks are sliced out of the packed sequence one at a time, so memory stays at the input and a single chunk.
+    for (size_t offset = 0; offset < nucls->len; offset += chunk_len) {
+        CHECK_FOR_INTERRUPTS();
+        NucleotideSequence* chunk = nucls->subsequence(offset, std::min<size_t>(chunk_len, nucls->len - offset));
+
+        std::array<bool, 2> nulls;
+        std::array<Datum, 2> values { {
+            Int64GetDatum(static_cast<int64_t>(offset)),
+            PointerGetDatum(chunk),
+        } };
+        nulls.fill(false);
+
+        tuplestore_putvalues(ret_tupstore, ret_tupdesc, values.data(), nulls.data());
+        pfree(chunk);
+    }
+
+    rsi->returnMode = SFRM_Materialize;
+    rsi->setResult = ret_tupstore;
+    rsi->setDesc = ret_tupdesc;
+    return (Datum) nullptr;
+}
+
+// Planner support for nuclseq_read_fasta, estimating the number of rows from the size of the file.
+PG_FUNCTION_INFO_V1(nuclseq_read_fasta_support);
+Datum nuclseq_read_fasta_support(PG_FUNCTION_ARGS) {
+    Node* request = reinterpret_cast<Node*>(PG_GETARG_POINTER(0));
+
+    if (!IsA(request, SupportRequestRows))
+        PG_RETURN_POINTER(nullptr);
+
+    auto rows_request = reinterpret_cast<SupportRequestRows*>(request);
+    if (!IsA(rows_request->node, FuncExpr))
+        PG_RETURN_POINTER(nullptr);
+
+    auto path_arg = reinterpret_cast<Node*>(linitial(reinterpret_cast<FuncExpr*>(rows_request->node)->args));
+    if (!IsA(path_arg, Const) || reinterpret_cast<Const*>(path_arg)->constisnull)
+        PG_RETURN_POINTER(nullptr);
+
+    // Without the privileges, the file will not be read anyway, and its size should not leak through EXPLAIN.
+    if (!has_privs_of_role(GetUserId(), ROLE_PG_READ_SERVER_FILES))
+        PG_RETURN_POINTER(nullptr);
+
+    double rows = estimate_fasta_records(TextDatumGetCString(reinterpret_cast<Const*>(path_arg)->constvalue));
+    if (rows < 0)
+        PG_RETURN_POINTER(nullptr);
+
+    rows_request->rows = rows;
+    PG_RETURN_POINTER(rows_request);
+}
+
+// Writes alignments of all queries straight to a server-side SAM, BAM or CRAM file, without materializing them as
+// bwa_result rows. Returns the number of written records.
+PG_FUNCTION_INFO_V1(nuclseq_search_bwa_to_bam);
+Datum nuclseq_search_bwa_to_bam(PG_FUNCTION_ARGS) {
+    const char* query_sql = PG_GETARG_CSTRING(0);
+    const char* reference_sql = PG_GETARG_CSTRING(1);
+    const char* path = text_to_cstring(PG_GETARG_TEXT_PP(2));
+    HeapTupleHeader opts = PG_GETARG_HEAPTUPLEHEADER(3);
+    std::string_view format = text_to_cstring(PG_GETARG_TEXT_PP(4));
+    bool sorted = PG_GETARG_BOOL(5);
+    unsigned threads = resolve_threads(PG_GETARG_INT32(6));
+
+    const char* mode = nullptr;
+    if (format == "sam")
+        mode = "w";
+    else if (format == "bam")
+        mode = "wb";
+    else if (format == "cram")
+        mode = "wc";
+    else
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("format must be one of 'sam', 'bam' or 'cram'"));
+
+    check_server_file_access(ROLE_PG_WRITE_SERVER_FILES, "pg_write_server_files");
+
+    MemoryContext call_ctx = CurrentMemoryContext;
+    if (int ret = SPI_connect(); ret < 0)
+        elog(ERROR, "connectby: SPI_connect returned %d", ret);
+
+    Oid nuclseq_oid = get_nuclseq_oid(fcinfo);
+
+    // Sorted output past work_mem is spilled to runs in the temporary directory of the database, like other sorts.
+    static uint32_t run_counter = 0;
+    char dir_path[MAXPGPATH], run_prefix[MAXPGPATH];
+    snprintf(dir_path, sizeof(dir_path), "base/%s", PG_TEMP_FILES_DIR);
+    snprintf(run_prefix, sizeof(run_prefix), "%s/%s%d.bam%u", dir_path, PG_TEMP_FILE_PREFIX, MyProcPid, run_counter++);
+    if (sorted)
+        MakePGDirectory(dir_path);
+
+    // The file is opened before the index is built, so that a bad path fails before a possibly long build.
+    BamWriter writer(path, mode, threads, sorted, static_cast<size_t>(work_mem) * 1024, run_prefix);
+    if (!writer.is_open())
+        ereport(ERROR, (errcode_for_file_access(), errmsg("could not create file \"%s\": %m", path)));
+
+    // The writer owns a file descriptor and compression threads, which must not outlive an error.
+    PG_TRY();
+    {
+        BwaIndex bwa = bwa_index_from_query(reference_sql, opts, nuclseq_oid, call_ctx);
+        bool ok = writer.write_header(bwa);
+
+        Portal portal = iterate_nuclseq_table(query_sql, nuclseq_oid, [&](auto id, auto nuclseq){
+            CHECK_FOR_INTERRUPTS();
+            if (!ok)
+                return;
+
+            char* query = nuclseq->to_text_palloc();
+            ok = writer.write_query(id, query, bwa.align_records(query), bwa.options->T);
+            pfree(query);
+        });
+        SPI_cursor_close(portal);
+
+        if (!writer.close())
+            raise_pg_error(ERRCODE_INTERNAL_ERROR, errmsg("could not export \"%s\": %s", path, writer.error().c_str()));
+    }
+    PG_CATCH();
+    {
+        writer.abort();
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    SPI_finish();
+
+    PG_RETURN_INT64(writer.records_written());
+}
+
+// Aligns the queries against a reference set split by a hash of the reference ids. The shards are loaded, searched and
+// freed one at a time, which bounds the memory to the largest shard, and keeps every index within the limits of
+// libbwa, at the cost of reading the references once per shard. Rows of every shard go to a tuplestore that spills to
+// disk, and only the fields needed to choose the primary alignments among all shards are kept in memory.
+PG_FUNCTION_INFO_V1(nuclseq_multi_search_bwa_sharded);
+Datum nuclseq_multi_search_bwa_sharded(PG_FUNCTION_ARGS) {
+    ReturnSetInfo* rsi = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+    assert_can_return_set(rsi);
+
+    const char* query_sql = PG_GETARG_CSTRING(0);
+    const char* reference_sql = PG_GETARG_CSTRING(1);
+    int32_t shards_num = PG_GETARG_INT32(2);
+    HeapTupleHeader opts = PG_GETARG_HEAPTUPLEHEADER(3);
+
+    if (shards_num < 1)
+        raise_pg_error(ERRCODE_INVALID_PARAMETER_VALUE, errmsg("shards must be positive"));
+
+    if (int ret = SPI_connect(); ret < 0)
+        elog(ERROR, "connectby: SPI_connect returned %d", ret);
+
+    TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
+    Oid nuclseq_oid = TupleDescAttr(ret_tupdesc, 1)->atttypid;
+    Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+    Tuplestorestate* shard_rows = tuplestore_begin_heap(false, false, work_mem);
+    MemoryContext row_ctx = AllocSetContextCreate(CurrentMemoryContext, "bwa rows", ALLOCSET_DEFAULT_SIZES);
+
+    std::unordered_map<int64_t, size_t> query_index;
+    std::vector<ShardMatch> matches;
+    float mask_level = 0;
+
+    const std::vector<size_t> pac_bytes = shard_pac_bytes(reference_sql, opts, nuclseq_oid, shards_num);
+    for (int32_t shard = 0; shard < shards_num; shard++) {
+        BwaIndex bwa(rsi->econtext->ecxt_per_query_memory);
+        bwa.reserve(pac_bytes[shard]);
+        set_bwa_options(bwa, opts, load_shard(reference_sql, nuclseq_oid, shard, shards_num, bwa));
+        bwa.build(index_memory_budget());
+        mask_level = bwa.options->mask_level;
+
+        Portal portal = iterate_nuclseq_table(query_sql, nuclseq_oid, [&](auto id, auto nuclseq){
+            CHECK_FOR_INTERRUPTS();
+            const size_t query = query_index.try_emplace(id, query_index.size()).first->second;
+
+            MemoryContext old_ctx = MemoryContextSwitchTo(row_ctx);
+            for (BwaMatch& row : bwa.align_sequence(*nuclseq)) {
+                matches.push_back({ query, row.query_match_begin, row.query_match_end, row.score });
+                tuplestore_puttuple(shard_rows, build_tuple_bwa(id, row, ret_tupdesc));
+            }
+            MemoryContextSwitchTo(old_ctx);
+            MemoryContextReset(row_ctx);
+        });
+        SPI_cursor_close(portal);
+    }
+
+    put_merged_rows(shard_rows, matches, query_index.size(), mask_level, ret_tupstore, ret_tupdesc);
+    tuplestore_end(shard_rows);
+    MemoryContextDelete(row_ctx);
+
+    SPI_finish();
+
+    rsi->returnMode = SFRM_Materialize;
+    rsi->setResult = ret_tupstore;
+    rsi->setDesc = ret_tupdesc;
+    return (Datum) nullptr;
+}
+
+// Gathers bwa_result rows of separately searched shards, e.g. partitions of the references or other databases queried
+// through dblink, and reassigns primary and secondary alignments among all alignments of every query.
+PG_FUNCTION_INFO_V1(nuclseq_merge_bwa_results);
+Datum nuclseq_merge_bwa_results(PG_FUNCTION_ARGS) {
+    ReturnSetInfo* rsi = reinterpret_cast<ReturnSetInfo*>(fcinfo->resultinfo);
+    assert_can_return_set(rsi);
+
+    const char* results_sql = PG_GETARG_CSTRING(0);
+    float mask_level = static_cast<float>(PG_GETARG_FLOAT8(1));
+
+    if (int ret = SPI_connect(); ret < 0)
+        elog(ERROR, "connectby: SPI_connect returned %d", ret);
+
+    TupleDesc ret_tupdesc = get_retval_tupledesc(fcinfo);
+    Tuplestorestate* ret_tupstore = create_tuplestore(rsi, ret_tupdesc);
+
+    // Rows wait in a tuplestore that spills to disk, and only the fields needed to choose the primary alignments are
+    // kept in memory. They are grouped by query id, rows of single searches have no query id and form a group of their
+    // own.
+    Tuplestorestate* shard_rows = tuplestore_begin_heap(false, false, work_mem);
+    std::map<std::optional<int64_t>, size_t> query_index;
+    std::vector<ShardMatch> matches;
+
+    Portal portal = SPI_cursor_open_with_args(nullptr, results_sql, 0, nullptr, nullptr, nullptr, true, 0);
+    SPI_cursor_fetch(portal, true, 1024);
+    while (SPI_processed > 0 && SPI_tuptable != NULL) {
+        SPITupleTable* tuptable = SPI_tuptable;
+
+        if (tuptable->tupdesc->natts != ret_tupdesc->natts)
+            raise_pg_error(ERRCODE_DATATYPE_MISMATCH, errmsg("expected rows of bwa_result"));
+        for (int i = 1; i <= ret_tupdesc->natts; i++) {
+            if (SPI_gettypeid(tuptable->tupdesc, i) != TupleDescAttr(ret_tupdesc, i - 1)->atttypid)
+                raise_pg_error(ERRCODE_DATATYPE_MISMATCH, errmsg("expected rows of bwa_result"));
+        }
+
+        for (uint64_t i = 0; i < SPI_processed; i++) {
+            HeapTuple tuple = tuptable->vals[i];
+            bool null_id = false, null_begin = false, null_end = false, null_score = false;
+            Datum id = SPI_getbinval(tuple, tuptable->tupdesc, 6, &null_id);
+            Datum begin = SPI_getbinval(tuple, tuptable->tupdesc, 8, &null_begin);
+            Datum end = SPI_getbinval(tuple, tuptable->tupdesc, 9, &null_end);
+            Datum score = SPI_getbinval(tuple, tuptable->tupdesc, 15, &null_score);
+
+            auto key = null_id ? std::nullopt : std::optional<int64_t>(DatumGetInt64(id));
+            const size_t query = query_index.try_emplace(key, query_index.size()).first->second;
+            matches.push_back({
+                query,
+                null_begin ? 0 : DatumGetInt32(begin),
+                null_end ? 0 : DatumGetInt32(end),
+                null_score ? 0 : DatumGetInt32(score),
+            });
+            tuplestore_puttuple(shard_rows, tuple);
+        }
+
+        SPI_freetuptable(tuptable);
+        SPI_cursor_fetch(portal, true, 1024);
+    }
+    SPI_cursor_close(portal);
+
+    put_merged_rows(shard_rows, matches, query_index.size(), mask_level, ret_tupstore, ret_tupdesc);
+    tuplestore_end(shard_rows);
+
+    SPI_finish();
+
+    rsi->returnMode = SFRM_Materialize;
+    rsi->setResult = ret_tupstore;
+    rsi->setDesc = ret_tupdesc;
+    return (Datum) nullptr;
+}
+
 }
@@ -0,0 +1,204 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <string>
+#include <sys/stat.h>
+
+#include "fasta.h"
+
+inline namespace {
+
+// Text sampled by estimate_fasta_records. Records are not parsed, as a single one may be a whole chromosome.
+constexpr size_t sample_bytes = 1 << 20;
+// Rough compression ratio of gzipped nucleotide text, used for estimates only.
+constexpr double compression_ratio = 4.0;
+
+void append_uppercase(std::string& out, const char* begin, size_t len) {
+    size_t old_size = out.size();
+    out.resize(old_size + len);
+    std::transform(begin, begin + len, out.begin() + old_size, [](char chr) {
+        return static_cast<char>(std::toupper(static_cast<unsigned char>(chr)));
+    });
+}
+
+}
+
+FastaReader::FastaReader(const char* path, unsigned threads):
+    file(bgzf_open(path, "r")), line(), line_pending(false), line_number(0), error_message(),
+    in_record(false), chunk_name(), chunk_offset(0), chunk_buffer() {
+    if (file != nullptr && threads > 1)
+        bgzf_mt(file, threads, 256);
+}
+
+FastaReader::~FastaReader() {
+    close();
+}
+
+void FastaReader::close() {
+    if (file != nullptr) {
+        bgzf_close(file);
+        file = nullptr;
+    }
+    free(line.s);
+    line = kstring_t();
+}
+
+bool FastaReader::fail(const std::string& message) {
+    error_message = "line " + std::to_string(line_number) + ": " + message;
+    return false;
+}
+
+bool FastaReader::read_line() {
+    if (line_pending) {
+        line_pending = false;
+        return true;
+    }
+
+    int ret = bgzf_getline(file, '\n', &line);
+    if (ret == -1)
+        return false;
+    if (ret < -1)
+        return fail("could not read the file");
+
+    line_number++;
+    if (line.l > 0 && line.s[line.l - 1] == '\r')
+        line.s[--line.l] = '\0';
+    return true;
+}
+
+bool FastaReader::next(FastaRecord& record) {
+    record.sequence.clear();
+    record.quality.clear();
+
+    do {
+        if (!read_line())
+            return false;
+    } while (line.l == 0);
+
+    if (line.s[0] != '>' && line.s[0] != '@')
+        return fail("expected a '>' or '@' header");
+
+    record.name.assign(line.s + 1, line.l - 1);
+    record.has_quality = line.s[0] == '@';
+
+    // In FASTA the sequence ends with the next header, in FASTQ with the '+' separator line.
+    const char terminator = record.has_quality ? '+' : '>';
+    bool terminated = false;
+    while (read_line()) {
+        if (line.l > 0 && line.s[0] == terminator) {
+            terminated = true;
+            break;
+        }
+        append_uppercase(record.sequence, line.s, line.l);
+    }
+
+    if (!error_message.empty())
+        return false;
+
+    if (!record.has_quality) {
+        if (terminated)
+            unread_line();
+        return true;
+    }
+
+    if (!terminated)
+        return fail("missing '+' line of record '" + record.name + "'");
+
+    // Quality lines may start with '@' or '+', so they are read until they cover the whole sequence.
+    while (record.quality.size() < record.sequence.size() && read_line())
+        record.quality.append(line.s, line.l);
+
+    if (!error_message.empty())
+        return false;
+    if (record.quality.size() != record.sequence.size())
+        return fail("quality and sequence lengths differ in record '" + record.name + "'");
+
+    return true;
+}
+
+bool FastaReader::next_chunk(FastaChunk& chunk, size_t chunk_len) {
+    bool record_end = false;
+    size_t len = 0;
+    // A record whose length is a multiple of chunk_len has no empty last chunk, and an empty record has no chunks at
+    // all, since a zero-length reference would only break the bwa index.
+    do {
+        if (record_end) {
+            in_record = false;
+            record_end = false;
+        }
+        while (chunk_buffer.size() < chunk_len && !record_end) {
+            if (!read_line()) {
+                if (!error_message.empty() || !in_record)
+                    return false;
+                record_end = true;
+            } else if (line.l == 0) {
+                continue;
+            } else if (line.s[0] == '>') {
+                if (in_record) {
+                    unread_line();
+                    record_end = true;
+                } else {
+                    chunk_name.assign(line.s + 1, line.l - 1);
+                    chunk_offset = 0;
+                    in_record = true;
+                }
+            } else if (!in_record) {
+                return fail(line.s[0] == '@' ? "FASTQ can not be read in chunks" : "expected a '>' header");
+            } else {
+                append_uppercase(chunk_buffer, line.s, line.l);
+            }
+        }
+        len = std::min(chunk_buffer.size(), chunk_len);
+    } while (record_end && len == 0);
+
+    chunk.name = chunk_name;
+    chunk.offset = chunk_offset;
+    chunk.sequence.assign(chunk_buffer, 0, len);
+    chunk_buffer.erase(0, len);
+    chunk_offset += len;
+
+    if (record_end && chunk_buffer.empty())
+        in_record = false;
+    return true;
+}
+
+double estimate_fasta_records(const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return -1;
+
+    BGZF* file = bgzf_open(path, "r");
+    if (file == nullptr)
+        return -1;
+
+    std::string sample(sample_bytes, '\0');
+    const ssize_t len = bgzf_read(file, sample.data(), sample.size());
+    const bool compressed = file->is_compressed;
+    bgzf_close(file);
+
+    if (len <= 0)
+        return -1;
+    sample.resize(len);
+
+    const size_t first = sample.find_first_not_of("\r\n");
+    if (first == std::string::npos)
+        return -1;
+
+    // FASTQ records take four lines, unless their sequences are wrapped. FASTA records are counted by their headers.
+    double records = 0;
+    if (sample[first] == '@') {
+        records = std::count(sample.begin(), sample.end(), '\n') / 4.0;
+    } else {
+        // The search starts at the first line, so that its header is not counted again after leading blank lines.
+        records = sample[first] == '>' ? 1 : 0;
+        for (size_t pos = sample.find("\n>", first); pos != std::string::npos; pos = sample.find("\n>", pos + 1))
+            records++;
+    }
+
+    // A sample shorter than asked for is the whole file.
+    if (static_cast<size_t>(len) < sample_bytes)
+        return std::max(1.0, records);
+
+    double file_bytes = static_cast<double>(st.st_size) * (compressed ? compression_ratio : 1.0);
+    return std::max(1.0, file_bytes * records / len);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <htslib/htslib/bgzf.h>
+#include <htslib/htslib/kstring.h>
+
+struct FastaRecord {
+    std::string name;
+    std::string sequence;
+    std::string quality;
+    bool has_quality;
+};
+
+// Part of a FASTA record, at position offset of its sequence.
+struct FastaChunk {
+    std::string name;
+    uint64_t offset;
+    std::string sequence;
+};
+
+// Streaming reader of FASTA and FASTQ files, either plain or compressed with gzip/BGZF. Nucleotides are uppercased,
+// but not validated. It does not call into Postgres, instead next() returns false and sets error() on malformed input.
+class FastaReader {
+public:
+    // BGZF blocks are decompressed on the given number of threads.
+    FastaReader(const char* path, unsigned threads);
+    ~FastaReader();
+
+    bool is_open() const { return file != nullptr; }
+    bool is_compressed() const { return file != nullptr && file->is_compressed; }
+    bool next(FastaRecord& record);
+    // Reads the next chunk of at most chunk_len nucleotides, so that a sequence of any length is read in bounded memory
+    // (apart from single lines, which are read whole). Only FASTA is supported. Records are not to be mixed with
+    // chunks in a single reader. Records without nucleotides are skipped.
+    bool next_chunk(FastaChunk& chunk, size_t chunk_len);
+    void close();
+
+    const std::string& error() const { return error_message; }
+
+private:
+    bool read_line();
+    void unread_line() { line_pending = true; }
+    bool fail(const std::string& message);
+
+    BGZF* file;
+    kstring_t line;
+    bool line_pending;
+    size_t line_number;
+    std::string error_message;
+    // State of next_chunk, the record being read and its nucleotides not yet returned.
+    bool in_record;
+    std::string chunk_name;
+    uint64_t chunk_offset;
+    std::string chunk_buffer;
+};
+
+// Estimates the number of records from the file size and the number of records in its first megabyte, so that planning
+// a query never reads much of the file. Returns a negative number if the file can not be read.
+double estimate_fasta_records(const char* path);
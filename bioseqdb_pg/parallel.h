@@ -0,0 +1,40 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// Worker threads must never call into Postgres (palloc, ereport, SPI...), as the backend is single threaded. Load the
+// data up front, run the kernel with parallel_for, and hand the results to Postgres on the calling thread.
+
+// Requests past the number of cores are capped, as they would not make anything faster, and every thread started inside
+// a backend costs memory for its stack.
+static inline unsigned resolve_threads(int32_t requested) {
+    const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    if (requested > 0)
+        return std::min(static_cast<unsigned>(requested), cores);
+    return cores;
+}
+
+// Calls f(task, worker) for every task in [0, tasks). Tasks are handed out one at a time from a shared counter, so
+// threads that get cheap tasks simply take more of them.
+template<typename F>
+void parallel_for(size_t tasks, unsigned threads, F f) {
+    threads = std::max(1u, std::min<unsigned>(threads, tasks));
+    std::atomic<size_t> next{0};
+
+    auto worker = [&](unsigned worker_id) {
+        for (size_t task = next++; task < tasks; task = next++)
+            f(task, worker_id);
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++)
+        pool.emplace_back(worker, i);
+    worker(0);
+
+    for (auto& thread : pool)
+        thread.join();
+}
@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "protein.h"
+#include "sequence.h"
+
+struct CodonTable {
+    int32_t id;
+    // Amino acid codes indexed by 6-bit codons in the order of the pac (A, C, G, T), for the forward strand and for the
+    // reverse complement read backwards.
+    std::array<uint8_t, 64> forward;
+    std::array<uint8_t, 64> reverse;
+};
+
+inline namespace {
+
+// Tables as published by NCBI, indexed by codons in TCAG order.
+constexpr std::pair<int32_t, std::string_view> ncbi_codon_tables[] = {
+    { 1, "FFLLSSSSYY**CC*WLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG" },
+    { 2, "FFLLSSSSYY**CCWWLLLLPPPPHHQQRRRRIIMMTTTTNNKKSS**VVVVAAAADDEEGGGG" },
+    { 3, "FFLLSSSSYY**CCWWTTTTPPPPHHQQRRRRIIMMTTTTNNKKSSRRVVVVAAAADDEEGGGG" },
+    { 4, "FFLLSSSSYY**CCWWLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG" },
+    { 5, "FFLLSSSSYY**CCWWLLLLPPPPHHQQRRRRIIMMTTTTNNKKSSSSVVVVAAAADDEEGGGG" },
+    { 11, "FFLLSSSSYY**CC*WLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG" },
+};
+
+std::vector<CodonTable> build_codon_tables() {
+    constexpr uint8_t tcag_index[4] = { 2, 1, 3, 0 };
+    std::vector<CodonTable> tables;
+
+    for (auto [id, ncbi] : ncbi_codon_tables) {
+        CodonTable& table = tables.emplace_back();
+        table.id = id;
+        for (uint8_t codon = 0; codon < 64; codon++) {
+            const uint8_t x = codon >> 4, y = codon >> 2 & 3, z = codon & 3;
+            table.forward[codon] = amino_code_from_char(ncbi[tcag_index[x] * 16 + tcag_index[y] * 4 + tcag_index[z]]);
+        }
+        for (uint8_t codon = 0; codon < 64; codon++) {
+            const uint8_t x = codon >> 4, y = codon >> 2 & 3, z = codon & 3;
+            table.reverse[codon] = table.forward[(3 - z) << 4 | (3 - y) << 2 | (3 - x)];
+        }
+    }
+
+    return tables;
+}
+
+// Nucleotides an IUPAC symbol stands for, as a bitmask indexed by the nucleotide codes.
+uint8_t nucleotide_mask(char symbol) {
+    switch (symbol) {
+        case 'A': return 0b0001;
+        case 'C': return 0b0010;
+        case 'G': return 0b0100;
+        case 'T': return 0b1000;
+        case 'W': return 0b1001;
+        case 'S': return 0b0110;
+        case 'M': return 0b0011;
+        case 'K': return 0b1100;
+        case 'R': return 0b0101;
+        case 'Y': return 0b1010;
+        case 'B': return 0b1110;
+        case 'D': return 0b1101;
+        case 'H': return 0b1011;
+        case 'V': return 0b0111;
+    }
+
+    return 0b1111;
+}
+
+uint8_t complement_mask(uint8_t mask) {
+    return (mask & 1) << 3 | (mask & 2) << 1 | (mask & 4) >> 1 | (mask & 8) >> 3;
+}
+
+uint8_t nucleotide_mask_at(const NucleotideSequence& seq, int64_t pos) {
+    const bntamb1_t* holes = seq.holes();
+    const bntamb1_t* hole = std::upper_bound(holes, holes + seq.holes_num, pos, [](int64_t p, const bntamb1_t& h) {
+        return p < h.offset;
+    });
+
+    if (hole != holes && pos < hole[-1].offset + hole[-1].len)
+        return nucleotide_mask(hole[-1].amb);
+    return 1 << pac_raw_get(seq.pac(), pos);
+}
+
+// Translates a codon with ambiguous nucleotides by trying all of its meanings.
+uint8_t translate_ambiguous(const std::array<uint8_t, 3>& masks, const CodonTable& table) {
+    uint32_t amino_acids = 0;
+    for (uint8_t x = 0; x < 4; x++) {
+        for (uint8_t y = 0; y < 4; y++) {
+            for (uint8_t z = 0; z < 4; z++) {
+                if ((masks[0] >> x & 1) && (masks[1] >> y & 1) && (masks[2] >> z & 1))
+                    amino_acids |= uint32_t(1) << table.forward[x << 4 | y << 2 | z];
+            }
+        }
+    }
+
+    auto bit = [](char chr) { return uint32_t(1) << amino_code_from_char(chr); };
+    if (__builtin_popcount(amino_acids) == 1)
+        return __builtin_ctz(amino_acids);
+    if (amino_acids == (bit('D') | bit('N')))
+        return amino_code_from_char('B');
+    if (amino_acids == (bit('I') | bit('L')))
+        return amino_code_from_char('J');
+    if (amino_acids == (bit('E') | bit('Q')))
+        return amino_code_from_char('Z');
+    return amino_code_from_char('X');
+}
+
+uint8_t read_codon(const ubyte_t* pac, int64_t pos) {
+    return pac_raw_get(pac, pos) << 4 | pac_raw_get(pac, pos + 1) << 2 | pac_raw_get(pac, pos + 2);
+}
+
+void pack_codes(const uint8_t* codes, size_t len, ubyte_t* out) {
+    uint64_t bits = 0;
+    unsigned filled = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        bits |= uint64_t(codes[i]) << filled;
+        filled += 5;
+        for (; filled >= 8; filled -= 8) {
+            *out++ = static_cast<ubyte_t>(bits);
+            bits >>= 8;
+        }
+    }
+
+    if (filled > 0)
+        *out = static_cast<ubyte_t>(bits);
+}
+
+}
+
+int32_t amino_code_from_char(char chr) {
+    size_t index = allowed_amino_acids.find(chr);
+    return index == std::string_view::npos ? -1 : static_cast<int32_t>(index);
+}
+
+uint8_t ProteinSequence::code(size_t index) const {
+    const size_t bit = index * 5;
+    uint32_t window = data[bit >> 3];
+    if ((bit >> 3) + 1 < protein_byte_size(len))
+        window |= data[(bit >> 3) + 1] << 8;
+    return window >> (bit & 7) & 31;
+}
+
+char* ProteinSequence::to_text_palloc() const {
+    auto text = reinterpret_cast<char*>(palloc(len + 1));
+    for (uint32_t i = 0; i < len; i++)
+        text[i] = allowed_amino_acids[code(i)];
+    text[len] = '\0';
+    return text;
+}
+
+ProteinSequence* protseq_alloc(uint32_t len) {
+    const auto size = offsetof(ProteinSequence, data) + protein_byte_size(len);
+    const auto ptr = static_cast<ProteinSequence*>(palloc0(size));
+
+    SET_VARSIZE(ptr, size);
+    ptr->len = len;
+
+    return ptr;
+}
+
+ProteinSequence* protseq_from_text(std::string_view str) {
+    std::vector<uint8_t> codes(str.size());
+    std::transform(str.begin(), str.end(), codes.begin(), amino_code_from_char);
+
+    ProteinSequence* prot = protseq_alloc(str.size());
+    pack_codes(codes.data(), codes.size(), prot->data);
+    return prot;
+}
+
+const CodonTable* find_codon_table(int32_t id) {
+    static const std::vector<CodonTable> tables = build_codon_tables();
+
+    auto table = std::find_if(tables.begin(), tables.end(), [id](const CodonTable& t) { return t.id == id; });
+    return table != tables.end() ? &*table : nullptr;
+}
+
+ProteinSequence* translate(const NucleotideSequence& seq, int32_t frame, const CodonTable& table) {
+    const bool reverse = frame < 0;
+    const int64_t shift = std::abs(frame) - 1;
+    const int64_t len = seq.len;
+    const int64_t codons_num = len > shift ? (len - shift) / 3 : 0;
+    const ubyte_t* pac = seq.pac();
+    std::vector<uint8_t> codes(codons_num);
+
+    // Start of codon c on the forward strand. Codons of the reverse frames are read backwards, from the last one.
+    auto codon_start = [&](int64_t c) { return reverse ? len - 3 - shift - 3 * c : shift + 3 * c; };
+    const uint8_t* lut = reverse ? table.reverse.data() : table.forward.data();
+
+    // Whenever 4 codons start at a byte boundary, they are translated from 3 whole bytes of the pac at once.
+    for (int64_t c = 0; c < codons_num;) {
+        const int64_t group_start = reverse ? codon_start(c + 3) : codon_start(c);
+        if (c + 4 <= codons_num && group_start % 4 == 0) {
+            const ubyte_t* bytes = pac + group_start / 4;
+            const uint32_t window = bytes[0] << 16 | bytes[1] << 8 | bytes[2];
+            const std::array<uint8_t, 4> group { {
+                lut[window >> 18 & 63], lut[window >> 12 & 63], lut[window >> 6 & 63], lut[window & 63]
+            } };
+            if (reverse)
+                std::reverse_copy(group.begin(), group.end(), codes.begin() + c);
+            else
+                std::copy(group.begin(), group.end(), codes.begin() + c);
+            c += 4;
+        } else {
+            codes[c] = lut[read_codon(pac, codon_start(c))];
+            c++;
+        }
+    }
+
+    // Holes are few, so the codons overlapping them are fixed afterwards.
+    for (const bntamb1_t* hole = seq.holes(); hole < seq.holes() + seq.holes_num; hole++) {
+        // The hole as positions of the translated strand.
+        const int64_t lo = reverse ? len - hole->offset - hole->len : hole->offset;
+        const int64_t hi = lo + hole->len;
+
+        const int64_t first = lo > shift ? (lo - shift) / 3 : 0;
+        const int64_t last = hi > shift ? std::min(codons_num, (hi - shift - 1) / 3 + 1) : 0;
+        for (int64_t c = first; c < last; c++) {
+            std::array<uint8_t, 3> masks;
+            for (int64_t i = 0; i < 3; i++) {
+                const int64_t pos = shift + 3 * c + i;
+                masks[i] = reverse ? complement_mask(nucleotide_mask_at(seq, len - 1 - pos)) : nucleotide_mask_at(seq, pos);
+            }
+            codes[c] = translate_ambiguous(masks, table);
+        }
+    }
+
+    ProteinSequence* prot = protseq_alloc(codons_num);
+    pack_codes(codes.data(), codes.size(), prot->data);
+    return prot;
+}
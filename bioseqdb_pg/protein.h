@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+extern "C" {
+#include <postgres.h>
+}
+
+#include "sequence.h"
+
+// Amino acids, followed by the ambiguity codes (B = D/N, J = I/L, Z = E/Q, X = any), the rare ones and stop.
+constexpr std::string_view allowed_amino_acids = "ACDEFGHIKLMNPQRSTVWYBJOUXZ*";
+
+// Amino acid codes take 5 bits each, packed least significant bit first. The padding bits of the last byte are zero,
+// so that equal sequences have equal bits.
+struct ProteinSequence {
+    size_t length() const { return len; }
+    uint8_t code(size_t index) const;
+    char* to_text_palloc() const;
+
+    char vl_len[4];
+    uint32_t len;
+    ubyte_t data[];
+};
+
+static inline size_t protein_byte_size(size_t len) { return (len * 5 + 7) / 8; }
+
+// Returns the code of the amino acid, or -1 if the symbol is not in allowed_amino_acids.
+int32_t amino_code_from_char(char chr);
+
+ProteinSequence* protseq_alloc(uint32_t len);
+ProteinSequence* protseq_from_text(std::string_view str);
+
+// Genetic codes by their NCBI numbers, nullptr if the code is not supported.
+struct CodonTable;
+const CodonTable* find_codon_table(int32_t id);
+
+// Translates the sequence in one of the frames 1, 2, 3 (starting at the given nucleotide) or -1, -2, -3 (the same on
+// the reverse complement). Codons overlapping ambiguous nucleotides are translated to the amino acid shared by all of
+// their possible meanings, to B, J or Z if there are two meanings covered by one of these, and to X otherwise.
+ProteinSequence* translate(const NucleotideSequence& seq, int32_t frame, const CodonTable& table);
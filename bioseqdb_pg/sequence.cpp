@@ -1,11 +1,10 @@
 #include <algorithm>
 #include <cstdint>
+#include <iterator>
 #include <random>
 
 #include "sequence.h"
 
-inline namespace {
-
 char complement_symbol(char c) {
     switch (c) {
         case 'A': return 'T';
@@ -28,6 +27,8 @@ char complement_symbol(char c) {
     return 'N';
 }
 
+inline namespace {
+
 template<typename F>
 void for_each_block(const NucleotideSequence& nucls, F f) {
     uint32_t p = 0;
@@ -58,7 +59,7 @@ uint32_t calculate_num_of_holes(std::string_view str) {
 
 NucleotideSequence* alloc_raw_nucls(uint32_t holes_num, uint32_t len) {
     // Postgresql requires logicaly same values to have same bits, so we use zero alloc to fill paddings of bntamb1_t.
-    const auto size = 4 * sizeof(uint32_t) + holes_num * sizeof(bntamb1_t) + pac_byte_size(len);
+    const auto size = offsetof(NucleotideSequence, data) + holes_num * sizeof(bntamb1_t) + pac_byte_size(len);
     const auto ptr = static_cast<NucleotideSequence*>(palloc0(size));
 
     SET_VARSIZE(ptr, size);
@@ -84,24 +85,17 @@ void inplace_to_text(const NucleotideSequence& nucls, char* text) {
 }
 
 uint32_t NucleotideSequence::occurences(char chr) const {
-    auto pac = this->pac();
-    auto holes = this->holes();
-
     const ubyte_t code = nuclcode_from_char(chr);
-    uint32_t count = 0;
+    if (code < 4)
+        return composition[code];
+    if (chr == 'N')
+        return composition[composition_n];
 
-    if (code >= 4) {
-        for(uint32_t i = 0 ; i < holes_num ; i++) {
-            if (holes[i].amb == chr)
-                count += holes[i].len;
-        }
-    } else {
-        for_each_block(*this, [&](uint32_t p, uint32_t q) {
-            for(uint32_t i = p; i < q ; i++) {
-                if(pac_raw_get(pac, i) == code)
-                    count++;
-            }
-        });
+    auto holes = this->holes();
+    uint32_t count = 0;
+    for(uint32_t i = 0 ; i < holes_num ; i++) {
+        if (holes[i].amb == chr)
+            count += holes[i].len;
     }
 
     return count;
@@ -113,6 +107,12 @@ NucleotideSequence* NucleotideSequence::complement() const {
     auto com_holes = com_nucls->holes();
     auto pac = this->pac();
 
+    // Complementing swaps A with T and C with G, while ambiguous symbols stay ambiguous.
+    for(size_t i = 0 ; i < 4 ; i++)
+        com_nucls->composition[i] = composition[0b11 - i];
+    com_nucls->composition[composition_n] = composition[composition_n];
+    com_nucls->composition[composition_other] = composition[composition_other];
+
     std::copy_n(holes(), holes_num, com_holes);
     for(uint32_t i = 0 ; i < holes_num ; i++) {
         const auto& hole = holes()[i];
@@ -138,6 +138,7 @@ NucleotideSequence* NucleotideSequence::reverse() const {
     auto holes = this->holes();
     std::minstd_rand rng(holes_num ^ len);
 
+    std::copy_n(composition, std::size(composition), rev_nucls->composition);
     for_each_block(*this, [&](uint32_t p, uint32_t q) {
         for(uint32_t i = p; i < q ; i++) {
             pac_raw_set(rev_pac, len - i - 1, pac_raw_get(pac, i));
@@ -148,7 +149,7 @@ NucleotideSequence* NucleotideSequence::reverse() const {
         const auto& hole = holes[i];
         auto& rev_hole = rev_holes[holes_num - i - 1];
         rev_hole = hole;
-        rev_hole.offset = len - hole.offset - 1;
+        rev_hole.offset = len - hole.offset - hole.len;
 
         for(uint32_t j = rev_hole.offset ; j < rev_hole.offset + rev_hole.len ; j++)
             pac_raw_set(rev_pac, j, rng() & 0b11);
@@ -160,6 +161,53 @@ NucleotideSequence* NucleotideSequence::reverse() const {
     return rev_nucls;
 }
 
+NucleotideSequence* NucleotideSequence::subsequence(uint32_t begin, uint32_t count) const {
+    const uint32_t end = begin + count;
+    auto holes = this->holes();
+    auto first_hole = std::partition_point(holes, holes + holes_num, [&](const bntamb1_t& hole) {
+        return hole.offset + hole.len <= begin;
+    });
+    auto last_hole = std::partition_point(first_hole, holes + holes_num, [&](const bntamb1_t& hole) {
+        return hole.offset < end;
+    });
+
+    auto sub_nucls = alloc_raw_nucls(static_cast<uint32_t>(last_hole - first_hole), count);
+    auto sub_pac = sub_nucls->pac();
+    auto sub_holes = sub_nucls->holes();
+    auto pac = this->pac();
+
+    for(auto hole = first_hole ; hole < last_hole ; hole++) {
+        auto& sub_hole = sub_holes[hole - first_hole];
+        const auto hole_begin = std::max<int64_t>(hole->offset, begin);
+        const auto hole_end = std::min<int64_t>(hole->offset + hole->len, end);
+        sub_hole.amb = hole->amb;
+        sub_hole.offset = hole_begin - begin;
+        sub_hole.len = static_cast<int32_t>(hole_end - hole_begin);
+        sub_nucls->composition[hole->amb == 'N' ? composition_n : composition_other] += sub_hole.len;
+    }
+
+    // Values inside holes are drawn in the same order as by nuclseq_from_text, so that equal sequences stay equal.
+    std::minstd_rand rng(sub_nucls->holes_num ^ count);
+    const bntamb1_t* hole = sub_holes;
+    for(uint32_t i = 0 ; i < count ; i++) {
+        if (hole < sub_holes + sub_nucls->holes_num && i >= hole->offset + hole->len)
+            hole++;
+
+        if (hole < sub_holes + sub_nucls->holes_num && i >= hole->offset) {
+            pac_raw_set(sub_pac, i, rng() & 0b11);
+        } else {
+            const auto code = pac_raw_get(pac, begin + i);
+            pac_raw_set(sub_pac, i, code);
+            sub_nucls->composition[code]++;
+        }
+    }
+
+    for(uint32_t i = count ; i < sub_nucls->padded_len ; i++)
+        pac_raw_set(sub_pac, i, rng() & 0b11);
+
+    return sub_nucls;
+}
+
 char* NucleotideSequence::to_text_palloc() const {
     auto text = reinterpret_cast<char*>(palloc(len + 1));
     inplace_to_text(*this, text);
@@ -179,7 +227,8 @@ NucleotideSequence* nuclseq_from_text(std::string_view str) {
 
     // libbwa requires random values inside holes, but again we want them to be deterministic => lcg
     std::minstd_rand rng(holes_num ^ str.size());
-    bntamb1_t* hole = nucls->holes();
+    bntamb1_t* holes = nucls->holes();
+    uint32_t hole_idx = 0;
     char prev_chr = 0;
 
     for(uint32_t idx = 0 ; idx < str.size() ; idx++) {
@@ -188,17 +237,19 @@ NucleotideSequence* nuclseq_from_text(std::string_view str) {
 
         if (code >= 4) {
             if (prev_chr == chr) {
-                hole->len++;
+                holes[hole_idx - 1].len++;
             } else {
-                hole++;
-                hole->amb = chr;
-                hole->offset = idx;
-                hole->len = 1;
+                bntamb1_t& hole = holes[hole_idx++];
+                hole.amb = chr;
+                hole.offset = idx;
+                hole.len = 1;
             }
             pac_raw_set(pac, idx, rng() & 0b11);
+            nucls->composition[chr == 'N' ? composition_n : composition_other]++;
         }
         else {
             pac_raw_set(pac, idx, code);
+            nucls->composition[code]++;
         }
 
         prev_chr = chr;
@@ -209,3 +260,37 @@ NucleotideSequence* nuclseq_from_text(std::string_view str) {
 
     return nucls;
 }
+
+void SequenceSet::add(int64_t id, const NucleotideSequence& seq) {
+    const size_t pac_bytes = pac_byte_size(seq.len);
+
+    ids.push_back(id);
+    lens.push_back(seq.len);
+    pac_offsets.push_back(pac_words.size());
+    hole_offsets.push_back(holes.size());
+
+    // One spare zero word keeps the last pac readable a whole word at a time.
+    const size_t old_size = pac_words.size();
+    pac_words.resize(old_size + pac_bytes / sizeof(uint64_t) + 1);
+    std::copy_n(seq.pac(), pac_bytes, reinterpret_cast<ubyte_t*>(pac_words.data() + old_size));
+    holes.insert(holes.end(), seq.holes(), seq.holes() + seq.holes_num);
+}
+
+void SequenceSet::clear() {
+    ids.clear();
+    lens.clear();
+    pac_offsets.clear();
+    hole_offsets.clear();
+    pac_words.clear();
+    holes.clear();
+}
+
+SequenceView SequenceSet::view(size_t index) const {
+    const size_t holes_end = index + 1 < hole_offsets.size() ? hole_offsets[index + 1] : holes.size();
+    return {
+        reinterpret_cast<const ubyte_t*>(pac_words.data() + pac_offsets[index]),
+        holes.data() + hole_offsets[index],
+        static_cast<uint32_t>(holes_end - hole_offsets[index]),
+        lens[index],
+    };
+}
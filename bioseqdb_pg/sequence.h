@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <string_view> 
+#include <vector>
 
 extern "C" {
 #include <bwa/bwt.h>
@@ -15,6 +17,19 @@ static_assert(alignof(bntamb1_t) == 8, "This should not happen");
 
 constexpr std::string_view allowed_nucleotides = "ACGTNWSMKRYBDHV";
 
+// Indices of NucleotideSequence::composition, the first four being the nucleotide codes.
+constexpr size_t composition_n = 4;
+constexpr size_t composition_other = 5;
+
+// Non-owning view of a packed sequence, usable both for detoasted values and for sequences copied out of Postgres
+// memory (e.g. to be processed by worker threads).
+struct SequenceView {
+    const ubyte_t* pac;
+    const bntamb1_t* holes;
+    uint32_t holes_num;
+    uint32_t len;
+};
+
 struct NucleotideSequence {
     uint32_t occurences(char symbol) const;
     size_t length() const { return len; }
@@ -27,18 +42,46 @@ struct NucleotideSequence {
 
     NucleotideSequence* complement() const;
     NucleotideSequence* reverse() const;
+    // Nucleotides [begin, begin + count), which must lie within the sequence. The result has the same bits as
+    // nuclseq_from_text of the corresponding text, but is built without converting the sequence to text.
+    NucleotideSequence* subsequence(uint32_t begin, uint32_t count) const;
     char* to_text_palloc() const;
     char* to_text_malloc() const;
-
+    SequenceView view() const { return { pac(), holes(), holes_num, len }; }
 
     char vl_len[4];
     uint32_t holes_num;
     uint32_t len;
     uint32_t padded_len;
+    // Counts of A, C, G, T, N and of the other ambiguous symbols. Together with len they fit in a detoasted slice of
+    // the header, so composition statistics never touch the holes or the pac.
+    uint32_t composition[6];
     ubyte_t data[];
 };
 
+static_assert(offsetof(NucleotideSequence, data) % alignof(bntamb1_t) == 0, "Holes must stay aligned");
+
 NucleotideSequence* nuclseq_from_text(std::string_view str);
+char complement_symbol(char c);
+
+// Compact copy of many sequences, kept outside of Postgres memory so it can be shared between threads. Every pac starts
+// at an 8-byte boundary, which lets kernels read it a machine word at a time.
+class SequenceSet {
+public:
+    void add(int64_t id, const NucleotideSequence& seq);
+    void clear();
+    size_t size() const { return ids.size(); }
+    int64_t id(size_t index) const { return ids[index]; }
+    SequenceView view(size_t index) const;
+
+private:
+    std::vector<int64_t> ids;
+    std::vector<uint32_t> lens;
+    std::vector<size_t> pac_offsets;
+    std::vector<size_t> hole_offsets;
+    std::vector<uint64_t> pac_words;
+    std::vector<bntamb1_t> holes;
+};
 
 static inline size_t pac_byte_size(size_t x) { return x / 4 + (x % 4 != 0 ? 1 : 0); }
 
@@ -0,0 +1,144 @@
+// Cross-checks MyersPattern against the textbook dynamic programming on random sequences. Patterns span up to a dozen
+// 64-row blocks, to exercise the carries between blocks, and max_dist is mostly small, to exercise the cutoffs.
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../bioseqdb_pg/edit_distance.h"
+
+namespace {
+
+// Packs a text sequence the way NucleotideSequence does: ambiguous symbols become holes, over arbitrary pac values.
+struct TestSequence {
+    explicit TestSequence(const std::string& text): len(text.size()), pac(text.size() / 4 + 1, 0) {
+        for (uint32_t i = 0; i < len; i++) {
+            auto code = std::string_view("ACGT").find(text[i]);
+            if (code == std::string_view::npos) {
+                if (!holes.empty() && holes.back().offset + holes.back().len == i && holes.back().amb == text[i]) {
+                    holes.back().len++;
+                } else {
+                    bntamb1_t hole{};
+                    hole.offset = i;
+                    hole.len = 1;
+                    hole.amb = text[i];
+                    holes.push_back(hole);
+                }
+                code = i % 4;
+            }
+            pac_raw_set(pac.data(), i, code);
+        }
+    }
+
+    SequenceView view() const { return { pac.data(), holes.data(), static_cast<uint32_t>(holes.size()), len }; }
+
+    uint32_t len;
+    std::vector<ubyte_t> pac;
+    std::vector<bntamb1_t> holes;
+};
+
+bool symbols_match(char a, char b) {
+    return a == b && std::string_view("ACGT").find(a) != std::string_view::npos;
+}
+
+// Distance of the pattern to the whole text (global), or the best distance to any substring of the text and the first
+// end at which it is reached (search).
+uint32_t naive_distance(const std::string& pattern, const std::string& text, bool global, uint32_t& end) {
+    const size_t m = pattern.size();
+    std::vector<uint32_t> prev(m + 1), cur(m + 1);
+    for (size_t i = 0; i <= m; i++)
+        prev[i] = i;
+
+    uint32_t best = m;
+    end = 0;
+    for (size_t j = 1; j <= text.size(); j++) {
+        cur[0] = global ? j : 0;
+        for (size_t i = 1; i <= m; i++) {
+            const uint32_t diagonal = prev[i - 1] + (symbols_match(pattern[i - 1], text[j - 1]) ? 0 : 1);
+            cur[i] = std::min({ prev[i] + 1, cur[i - 1] + 1, diagonal });
+        }
+        if (cur[m] < best) {
+            best = cur[m];
+            end = j;
+        }
+        std::swap(prev, cur);
+    }
+    return global ? prev[m] : best;
+}
+
+std::string random_sequence(std::mt19937& rng, size_t len) {
+    std::string text;
+    for (size_t i = 0; i < len; i++)
+        text += rng() % 10 == 0 ? 'N' : "ACGT"[rng() % 4];
+    return text;
+}
+
+// Substitutions, insertions and deletions at random positions, and sometimes random flanks around the result.
+std::string mutate(std::mt19937& rng, std::string text, uint32_t edits) {
+    for (uint32_t e = 0; e < edits && !text.empty(); e++) {
+        const size_t pos = rng() % text.size();
+        switch (rng() % 3) {
+            case 0: text[pos] = "ACGT"[rng() % 4]; break;
+            case 1: text.erase(pos, 1); break;
+            default: text.insert(pos, 1, "ACGT"[rng() % 4]); break;
+        }
+    }
+    if (rng() % 2 == 0)
+        text = random_sequence(rng, rng() % 100) + text + random_sequence(rng, rng() % 100);
+    return text;
+}
+
+int failures = 0;
+
+void check(const std::string& pattern, const std::string& text, uint32_t max_dist) {
+    const TestSequence p(pattern), t(text);
+    const MyersPattern myers(p.view());
+
+    uint32_t expected_end = 0;
+    const uint32_t global = naive_distance(pattern, text, true, expected_end);
+    const uint32_t expected = std::min(global, max_dist + 1);
+    const uint32_t distance = myers.distance(t.view(), max_dist);
+    if (distance != expected && failures++ < 10) {
+        std::fprintf(stderr, "distance, max_dist %u: expected %u, got %u\n  %s\n  %s\n", max_dist, expected, distance,
+                pattern.c_str(), text.c_str());
+    }
+
+    const uint32_t local = naive_distance(pattern, text, false, expected_end);
+    const EditMatch match = myers.search(t.view(), max_dist);
+    const bool found = local <= max_dist;
+    if ((match.distance != std::min(local, max_dist + 1) || (found && match.end != expected_end)) && failures++ < 10) {
+        std::fprintf(stderr, "search, max_dist %u: expected %u at %u, got %u at %u\n  %s\n  %s\n", max_dist,
+                std::min(local, max_dist + 1), expected_end, match.distance, match.end, pattern.c_str(), text.c_str());
+    }
+}
+
+}
+
+int main() {
+    std::mt19937 rng(1);
+
+    // Edge cases: empty sequences, and a pattern just past a block boundary whose last block is only reached late.
+    check("", "", 0);
+    check("", "ACGT", 2);
+    check("ACGT", "", 2);
+    check("NNNN", "NNNN", 8);
+    const std::string boundary = random_sequence(rng, 71);
+    check(boundary, mutate(rng, boundary, 1), 1);
+
+    for (int i = 0; i < 30000; i++) {
+        const std::string pattern = random_sequence(rng, rng() % (i % 2 == 0 ? 700 : 300));
+        const std::string text = rng() % 2 == 0 ? mutate(rng, pattern, rng() % (i % 3 == 0 ? 80 : 20))
+                : random_sequence(rng, rng() % 700);
+        const uint32_t max_dist = rng() % 3 == 0 ? rng() % 400 : rng() % 30;
+        check(pattern, text, max_dist);
+    }
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    return 0;
+}
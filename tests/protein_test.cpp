@@ -0,0 +1,182 @@
+// Cross-checks translate against a naive per-codon translation of the text on random sequences, in all six frames and
+// for every length up to a few dozen codons, with ambiguity codes at random positions.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../bioseqdb_pg/protein.h"
+
+// translate allocates its result with palloc, which the backend provides.
+extern "C" {
+void* palloc(Size size) { return std::malloc(size); }
+void* palloc0(Size size) { return std::calloc(1, size); }
+}
+
+namespace {
+
+constexpr std::string_view ambiguous_nucleotides = "NWSMKRYBDHV";
+
+// Packs a text sequence the way nuclseq_from_text does: ambiguous symbols become holes, over arbitrary pac values.
+struct TestSequence {
+    explicit TestSequence(const std::string& text) {
+        std::vector<bntamb1_t> holes;
+        for (uint32_t i = 0; i < text.size(); i++) {
+            if (std::string_view("ACGT").find(text[i]) != std::string_view::npos)
+                continue;
+            if (!holes.empty() && holes.back().offset + holes.back().len == i && holes.back().amb == text[i]) {
+                holes.back().len++;
+            } else {
+                bntamb1_t hole{};
+                hole.offset = i;
+                hole.len = 1;
+                hole.amb = text[i];
+                holes.push_back(hole);
+            }
+        }
+
+        const size_t size = offsetof(NucleotideSequence, data) + holes.size() * sizeof(bntamb1_t) + text.size() / 4 + 1;
+        storage.resize(size / sizeof(uint64_t) + 1);
+        seq = reinterpret_cast<NucleotideSequence*>(storage.data());
+        seq->holes_num = holes.size();
+        seq->len = text.size();
+        seq->padded_len = text.size() / 4 * 4 + 4;
+        std::copy(holes.begin(), holes.end(), seq->holes());
+        for (uint32_t i = 0; i < text.size(); i++) {
+            const auto code = std::string_view("ACGT").find(text[i]);
+            pac_raw_set(seq->pac(), i, code != std::string_view::npos ? code : i % 4);
+        }
+    }
+
+    std::vector<uint64_t> storage;
+    NucleotideSequence* seq;
+};
+
+// Tables 1 and 2 as published by NCBI, indexed by codons in TCAG order.
+constexpr std::pair<int32_t, std::string_view> ncbi_codon_tables[] = {
+    { 1, "FFLLSSSSYY**CC*WLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG" },
+    { 2, "FFLLSSSSYY**CCWWLLLLPPPPHHQQRRRRIIMMTTTTNNKKSS**VVVVAAAADDEEGGGG" },
+};
+
+std::string_view expansion(char symbol) {
+    switch (symbol) {
+        case 'A': return "A";
+        case 'C': return "C";
+        case 'G': return "G";
+        case 'T': return "T";
+        case 'W': return "AT";
+        case 'S': return "CG";
+        case 'M': return "AC";
+        case 'K': return "GT";
+        case 'R': return "AG";
+        case 'Y': return "CT";
+        case 'B': return "CGT";
+        case 'D': return "AGT";
+        case 'H': return "ACT";
+        case 'V': return "ACG";
+    }
+    return "ACGT";
+}
+
+char complement(char symbol) {
+    constexpr std::string_view from = "ACGTNWSMKRYBDHV", to = "TGCANWSKMYRVHDB";
+    return to[from.find(symbol)];
+}
+
+char translate_codon(std::string_view codon, std::string_view ncbi) {
+    std::string amino_acids;
+    for (char x : expansion(codon[0])) {
+        for (char y : expansion(codon[1])) {
+            for (char z : expansion(codon[2])) {
+                const char amino_acid = ncbi[std::string_view("TCAG").find(x) * 16
+                        + std::string_view("TCAG").find(y) * 4 + std::string_view("TCAG").find(z)];
+                if (amino_acids.find(amino_acid) == std::string::npos)
+                    amino_acids += amino_acid;
+            }
+        }
+    }
+
+    if (amino_acids.size() == 1)
+        return amino_acids[0];
+    std::sort(amino_acids.begin(), amino_acids.end());
+    if (amino_acids == "DN")
+        return 'B';
+    if (amino_acids == "IL")
+        return 'J';
+    if (amino_acids == "EQ")
+        return 'Z';
+    return 'X';
+}
+
+std::string naive_translate(const std::string& text, int32_t frame, std::string_view ncbi) {
+    std::string strand = text;
+    if (frame < 0) {
+        std::reverse(strand.begin(), strand.end());
+        std::transform(strand.begin(), strand.end(), strand.begin(), complement);
+    }
+
+    std::string protein;
+    for (size_t pos = std::abs(frame) - 1; pos + 3 <= strand.size(); pos += 3)
+        protein += translate_codon(std::string_view(strand).substr(pos, 3), ncbi);
+    return protein;
+}
+
+std::string random_sequence(std::mt19937& rng, size_t len, bool holes) {
+    std::string text;
+    for (size_t i = 0; i < len; i++) {
+        if (!holes || rng() % 8 != 0)
+            text += "ACGT"[rng() % 4];
+        else
+            text.append(1 + rng() % 3, ambiguous_nucleotides[rng() % ambiguous_nucleotides.size()]);
+    }
+    text.resize(len);
+    return text;
+}
+
+int failures = 0;
+
+void check(const std::string& text) {
+    const TestSequence sequence(text);
+    for (auto [id, ncbi] : ncbi_codon_tables) {
+        for (int32_t frame : { 1, 2, 3, -1, -2, -3 }) {
+            ProteinSequence* prot = translate(*sequence.seq, frame, *find_codon_table(id));
+            std::string result;
+            for (size_t i = 0; i < prot->length(); i++)
+                result += allowed_amino_acids[prot->code(i)];
+            std::free(prot);
+
+            const std::string expected = naive_translate(text, frame, ncbi);
+            if (result != expected && failures++ < 10) {
+                std::fprintf(stderr, "table %d, frame %d: expected %s, got %s\n  %s\n", id, frame, expected.c_str(),
+                        result.c_str(), text.c_str());
+            }
+        }
+    }
+}
+
+}
+
+int main() {
+    std::mt19937 rng(1);
+
+    // Every symbol alone and as a whole codon, then random sequences of every length, some of them without holes to
+    // exercise the translation of whole bytes of the pac.
+    for (char symbol : std::string_view("ACGTNWSMKRYBDHV")) {
+        check(std::string(1, symbol));
+        check(std::string(3, symbol));
+    }
+    for (size_t len = 0; len <= 40; len++) {
+        for (int i = 0; i < 300; i++)
+            check(random_sequence(rng, len, i % 4 != 0));
+    }
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d failures\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -16,11 +16,7 @@ psql "${DB_URI}" -f up.sql
 for fasta in "${DATASET_PATH}/"*.fasta; do
   meta="${fasta%.fasta}.meta.csv"
 
-  # Adjust sequence header to match import tool's format.
-  sed -i 's/|.*//' "${fasta}"
-  # Pass correct filenames to real import tool.
-  bioseqdb_import dataset strain seq "${fasta}"
-  # Add all metadata to enties.
-  python import-metadata.py "${meta}"
+  # Sequences are joined with their metadata and loaded in a single pass.
+  bioseqdb_import dataset strain seq "${fasta}" "${meta}" import.conf
   echo "imported ${fasta} ${meta}"
 done